@@ -7,13 +7,88 @@
 #define NON_LEAF_KEY_NUM 14 // node size
 #endif
 // #define NON_LEAF_KEY_NUM (64) //node size
-#define LEAF_KEY_NUM (14)
-#define CACHE_KEY_NUM (2)
 
-#define bitScan(x) __builtin_ffs(x)
-#define countBit(x) __builtin_popcount(x)
+#ifndef LEAF_NODE_SIZE
+#define LEAF_NODE_SIZE 256
+#endif
+#ifndef BUFFER_SLOTS
+#define BUFFER_SLOTS 2
+#endif
+
+// The layout of the leaf nodes and bnodes, derived from the size of a leaf node and the
+// number of kvs a bnode caches. A leaf node holds a meta region and 16-byte kvs, the
+// fingerprints of the meta region fill whole 16-byte vectors. Up to 16 kvs, the bitmap
+// shares one word with the next pointer (256-byte leaf nodes: 14 kvs), otherwise they
+// take a word each (512 bytes: 28 kvs, 1024 bytes: 58 kvs). The tree, its pages and
+// bnodes are not templated on it: a build holds the one geometry of LEAF_NODE_SIZE and
+// BUFFER_SLOTS, as its NVM pools, logs and GC serve a single node size.
+template <int leaf_size, int buffer_slots>
+struct ff_geometry
+{
+    static constexpr int fgpt_size_of(int n) { return (n + 15) / 16 * 16; }
+    static constexpr int meta_size_of(int n) { return n <= 16 ? 16 + fgpt_size_of(n) : (24 + fgpt_size_of(n) + 15) / 16 * 16; }
+    static constexpr int keys_of()
+    {
+        int n = 64;
+        while (meta_size_of(n) + 16 * n > leaf_size)
+            n--;
+        return n;
+    }
+
+    static constexpr int keys = keys_of();
+    static constexpr bool shared_word = keys <= 16;
+    static constexpr int fgpt_size = fgpt_size_of(keys);
+    static constexpr int meta_size = meta_size_of(keys);
+    static constexpr int lines = leaf_size / 64;
+    static constexpr int fgpt_vectors = fgpt_size / 16; // SSE compares per probe
+    static constexpr uint64_t full_bitmap = (keys == 64) ? ~0ULL : (1ULL << keys) - 1;
+    static constexpr int line_of(int slot) { return (meta_size + 16 * slot) / 64; }
+    static constexpr int cache_keys = buffer_slots;
+
+    static_assert(leaf_size == 256 || leaf_size == 512 || leaf_size == 1024, "a leaf node is 256, 512 or 1024 bytes");
+    static_assert(buffer_slots >= 1 && buffer_slots <= 6, "a bnode tracks its cached kvs in 6 bits");
+};
+
+typedef ff_geometry<LEAF_NODE_SIZE, BUFFER_SLOTS> leaf_geometry;
+
+#define LEAF_KEY_NUM (leaf_geometry::keys)
+#define CACHE_KEY_NUM (leaf_geometry::cache_keys)
+#define LEAF_LINES (leaf_geometry::lines)
+#define LEAF_FULL_BITMAP (leaf_geometry::full_bitmap)
+#define LEAF_LINE_OF(slot) (leaf_geometry::line_of(slot))
+
+// A leaf node left with at most LEAF_MERGE_NUM kvs by a flush is merged into its left
+// sibling under the same inode, if the sibling then holds at most LEAF_MERGE_MAX kvs.
+#define LEAF_MERGE_NUM (LEAF_KEY_NUM / 4)
+#define LEAF_MERGE_MAX (LEAF_KEY_NUM * 3 / 4)
+
+#define bitScan(x) __builtin_ffsll(x)
+#define countBit(x) __builtin_popcountll(x)
+
+// The fingerprint and bnode cache probes and the inner page searches take the widest
+// vectors of the CPU, up to SIMD_PROBE_MAX. A kernel is inlined where the build targets
+// its instruction set.
+#ifndef SIMD_PROBE_MAX
+#define SIMD_PROBE_MAX 2
+#endif
+enum
+{
+    SIMD_SSE,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
 
-#define MUTEX
+static int simd_probe_level()
+{
+    __builtin_cpu_init();
+    int level = SIMD_SSE;
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+        level = SIMD_AVX512;
+    else if (__builtin_cpu_supports("avx2"))
+        level = SIMD_AVX2;
+    return std::min(level, SIMD_PROBE_MAX);
+}
+inline int simd_level = simd_probe_level();
 
 volatile bool signal_do_recycle;
 
@@ -23,9 +98,24 @@ void sfence()
     // _mm_mfence();
 }
 
+// With STRING_KEY the keys are variable-length strings, see tools/str_key.h. Key 0 is
+// the smallest key and LONG_MAX the largest in both modes.
+#ifdef STRING_KEY
+#if defined(LOG_COMPACT_ENTRY) || defined(NUMA_TEST)
+#error "STRING_KEY needs the full log entries of one NVM pool"
+#endif
+#ifdef SCAN_REVERSE
+#error "no reverse scan with STRING_KEY"
+#endif
+using entry_key_t = str_key;
+#else
+using entry_key_t = int64_t;
+static inline uint64_t key_raw(int64_t k) { return k; }
+#endif
+
 typedef struct leaf_entry
 {
-    key_type_sob k;
+    entry_key_t k;
     char *v;
 } leaf_entry;
 
@@ -57,14 +147,55 @@ typedef struct bnode
  *
  *
  */
-typedef struct lnodeMeta
+template <typename G, bool shared_word = G::shared_word>
+struct lnode_meta;
+
+template <typename G>
+struct lnode_meta<G, true>
 {
-    uint64_t bitmap : 14;
+    uint64_t bitmap : G::keys;
     uint64_t next : 48;
     uint64_t timestamp;
-    unsigned char fgpt[LEAF_KEY_NUM]; /* fingerprints */
-    unsigned char padding[2];
-} lnodeMeta;
+    unsigned char fgpt[G::fgpt_size]; /* fingerprints */
+
+    void publish(const lnode_meta *m, bool)
+    {
+        memcpy(this, m, sizeof(lnode_meta)); // should be 2 memcpy(addr , m , 8)
+    }
+};
+
+// next and the bitmap are in the same cache line, and a line is written back with the
+// words stored up to some point, see lnode::setMeta()
+template <typename G>
+struct lnode_meta<G, false>
+{
+    uint64_t next;
+    uint64_t bitmap;
+    unsigned char fgpt[G::fgpt_size]; /* fingerprints */
+    uint64_t timestamp;
+    unsigned char padding[G::meta_size - 24 - G::fgpt_size];
+
+    void publish(const lnode_meta *m, bool bitmap_first)
+    {
+        memcpy(fgpt, m->fgpt, sizeof(fgpt));
+        timestamp = m->timestamp;
+        if (sizeof(lnode_meta) > CACHE_LINE_SIZE)
+            clflush((char *)this + CACHE_LINE_SIZE, sizeof(lnode_meta) - CACHE_LINE_SIZE);
+        asm volatile("" ::: "memory");
+        if (bitmap_first)
+        {
+            *(volatile uint64_t *)&bitmap = m->bitmap;
+            *(volatile uint64_t *)&next = m->next;
+        }
+        else
+        {
+            *(volatile uint64_t *)&next = m->next;
+            *(volatile uint64_t *)&bitmap = m->bitmap;
+        }
+    }
+};
+
+typedef lnode_meta<leaf_geometry> lnodeMeta;
 
 class lnode
 {
@@ -73,30 +204,49 @@ public:
     leaf_entry ent[LEAF_KEY_NUM];
 
 public:
-    key_type_sob &k(int idx) { return ent[idx].k; }
+    entry_key_t &k(int idx) { return ent[idx].k; }
     char *&ch(int idx) { return ent[idx].v; }
 
     int num() { return countBit(meta.bitmap); }
 
-    bool isFull(void) { return (meta.bitmap == 0x3fff); }
+    bool isFull(void) { return (meta.bitmap == LEAF_FULL_BITMAP); }
     bool isAlmostFull(int a) { return (countBit(meta.bitmap) + a) > LEAF_KEY_NUM; }
 
-    void setMeta(lnodeMeta *m)
+    // The caller writes back the first line. Without the shared word, the fingerprints
+    // are persisted first, then next is stored before the bitmap unless bitmap_first.
+    // A crash may then leave kvs both in this leaf node and the next one, which
+    // recover() drops from this one.
+    void setMeta(lnodeMeta *m, bool bitmap_first = false)
     {
-        memcpy(&meta, m, sizeof(lnodeMeta)); // should be 2 memcpy(addr , m , 8)
+        meta.publish(m, bitmap_first);
     }
 }; // leafnode
 
+static_assert(sizeof(lnodeMeta) == leaf_geometry::meta_size && sizeof(lnode) == LEAF_NODE_SIZE, "");
+
+static inline void pref_lnode(lnode *ln)
+{
+    for (int i = 0; i < LEAF_LINES; i++)
+        pref(*((char *)ln + i * CACHE_LINE_SIZE));
+}
+
+/**
+ * treeRoot: persistent entry of the tree, kept in the root area of the NVM pool header.
+ *
+ */
+typedef struct treeRoot
+{
+    uint64_t first_lnode;
+} treeRoot;
+
 #ifndef UNIFIED_NODE
 #define PAGESIZE 512 // ori 512
 #else
-#define PAGESIZE 256 // node size
+#define PAGESIZE LEAF_NODE_SIZE // node size
 #endif
 
 #define IS_FORWARD(c) (c % 2 == 0)
 
-using entry_key_t = int64_t;
-
 inline bool get_lock_bnode(bnode *bn, uint8_t op_type, uint8_t &version)
 {
     if (bn == NULL)
@@ -157,7 +307,7 @@ inline void qsortBleaf(lnode *p, int start, int end, int pos[])
         return;
 
     int pos_start = pos[start];
-    key_type_sob key = p->k(pos_start); // pivot
+    entry_key_t key = p->k(pos_start); // pivot
     int l, r;
 
     l = start;
@@ -186,6 +336,41 @@ inline void qsortBleaf(lnode *p, int start, int end, int pos[])
 
 class page;
 
+// the number of bnodes a GC thread recycles before it yields, see recycle_bottom()
+#ifndef GC_SLICE_BNODES
+#define GC_SLICE_BNODES 256
+#endif
+
+// the number of lookups multi_get() runs in lockstep
+#ifndef MULTI_GET_GROUP
+#define MULTI_GET_GROUP 8
+#endif
+
+typedef struct gc_stats
+{
+    uint64_t cycles;
+    uint64_t slices;
+    uint64_t bnodes;       // visited bnodes
+    uint64_t relogged;     // cached kvs logged again into the new epoch
+    uint64_t deferred;     // bnodes skipped while a writer held them, recycled at the end
+    uint64_t pause_tot_ns; // the time spent in slices
+    uint64_t pause_max_ns; // the longest slice
+} gc_stats_t;
+
+// The value of a deleted key in bnodes and logs, so that NULL is a value like any other.
+// It is also the value of the minimum kv (key 0) of the first leaf node, key 0 is not
+// a key of the tree. With compact log entries it is the largest value they hold.
+#ifdef LOG_COMPACT_ENTRY
+#define TOMBSTONE ((char *)LOG_COMPACT_MAX_KEY)
+#else
+#define TOMBSTONE ((char *)~0ULL)
+#endif
+
+// The merge operator of upsert_with(): the new value of a key from its old value,
+// TOMBSTONE if absent, and the operand. A new value TOMBSTONE deletes the key, and
+// returning old leaves the tree as it is.
+typedef char *(*merge_fn)(char *old, char *operand);
+
 class btree
 {
 private:
@@ -194,10 +379,11 @@ private:
 
 public:
     int epoch_num;
+    gc_stats_t gc_stats;
     lnode *first_lnode;
     page *first_inode;
 
-    btree();
+    btree(bool is_recovery = false);
     ~btree();
     void setNewRoot(char *);
     void getNumberOfNodes();
@@ -210,28 +396,52 @@ public:
 
     void printAll();
     void printinfo_leaf();
-    bool insert(entry_key_t, char *, bool update); // Insert
+    bool insert(entry_key_t, char *, bool update, merge_fn merge = NULL, char *operand = NULL, char **old = NULL); // Insert
+    void upsert_with(entry_key_t key, merge_fn fn, char *operand);
+    bool insert_if_absent(entry_key_t key, char *val);
+    bool update_if_present(entry_key_t key, char *val);
+    bool compare_and_swap(entry_key_t key, char *expected, char *desired);
+    bool erase(entry_key_t key);
+#ifdef VALUE_HEAP
+    void put_value(entry_key_t key, const char *data, int len);
+    int get_value(entry_key_t key, char *buf);
+    bool erase_value(entry_key_t key);
+#endif
     bool insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val, bool update);
+    void insert_batch(entry_key_t *keys, char **vals, int n);
+    int insert_run(leaf_entry *run, int n);
+    bool merge_into_left_leaf(bnode *bn, page *parent, leaf_entry *key_group, unsigned char *key_hash_group, int8_t *slot_id);
     void remove(entry_key_t);                                                  // Remove
     char *search(entry_key_t);                                                 // Search
+    bool search(entry_key_t key, char **val);
+    void multi_get(entry_key_t *keys, int n, char **vals, bool *found);
+#ifdef __cpp_impl_coroutine
+    coro_task search_coro(entry_key_t key, char **val, bool *found);
+    coro_task insert_coro(entry_key_t key, char *val, bool update);
+    coro_task scan_coro(entry_key_t key, uint64_t len, std::vector<value_type_sob> *buf);
+#endif
     int scan(entry_key_t key, uint64_t len, std::vector<value_type_sob> &buf); // Scan
 
-    bnode *get_the_target_bnode(entry_key_t key, uint8_t op_type, bnode **pred, page **inode);
+    bnode *get_the_target_bnode(entry_key_t key, uint8_t op_type, bnode **pred, page **inode, entry_key_t *upper = NULL, page *from = NULL, entry_key_t *lower = NULL);
     void recycle_bottom();
+    void recycle_range(page *from, page *to);
     void recycle_bottom_naive();
     void clean_bottom();
+
+    void print_gc_stats();
+
+    void recover();
+    void bulkload(entry_key_t *keys, char **vals, uint64_t n, float bfill);
+    void build_inner_layer(std::vector<entry_key_t> &keys, std::vector<char *> &ptrs);
+    uint64_t replay_logs(std::vector<log_entry_t> &entries);
     friend class page;
 };
 
 class header
 {
 private:
-#ifdef MUTEX
-    std::mutex *mtx; // 8 bytes
-#else
-    pthread_rwlock_t *rwlock; // 8 bytes
-#endif
-    uint64_t leftmost_ptr : 48; // 8 bytes
+    volatile uint64_t version_lock; // 8 bytes, bit 0 is the lock bit, see page::write_lock()
+    uint64_t leftmost_ptr : 48;     // 8 bytes
     uint8_t switch_counter : 15;
     uint8_t is_deleted : 1;
     uint64_t sibling_ptr : 48; // 8 bytes
@@ -245,15 +455,7 @@ private:
 public:
     header()
     {
-#ifdef MUTEX
-        mtx = new std::mutex();
-#else
-        rwlock = new pthread_rwlock_t;
-
-        pthread_rwlockattr_t attr;
-        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
-        pthread_rwlock_init(rwlock, &attr);
-#endif
+        version_lock = 0;
         leftmost_ptr = NULL;
         sibling_ptr = NULL;
         // pred_ptr = NULL;
@@ -263,15 +465,6 @@ public:
 
         minkey = 0;
     }
-
-    ~header()
-    {
-#ifdef MUTEX delete mtx;
-#else
-        pthread_rwlock_destroy(rwlock);
-        delete rwlock;
-#endif
-    }
 };
 
 class entry
@@ -332,6 +525,40 @@ public:
         return ret;
     }
 
+    // Inline version lock: writers hold it with bit 0 set, and every unlock moves the
+    // version on. Readers do not take it, they retry if the version has changed.
+    inline void write_lock()
+    {
+        while (true)
+        {
+            uint64_t v = hdr.version_lock;
+            if (!(v & 1) && __sync_bool_compare_and_swap(&hdr.version_lock, v, v + 1))
+                return;
+            _mm_pause();
+        }
+    }
+
+    inline void write_unlock()
+    {
+        asm volatile("" ::: "memory");
+        hdr.version_lock = hdr.version_lock + 1;
+    }
+
+    // wait for the writer and return the version to validate against
+    inline uint64_t read_version()
+    {
+        uint64_t v;
+        while ((v = hdr.version_lock) & 1)
+            _mm_pause();
+        return v;
+    }
+
+    inline bool validate_version(uint64_t v)
+    {
+        asm volatile("" ::: "memory");
+        return hdr.version_lock == v;
+    }
+
     inline int count()
     {
         uint8_t previous_switch_counter;
@@ -396,11 +623,7 @@ public:
 
     bool remove(btree *bt, entry_key_t key, bool with_lock = true)
     {
-#ifdef MUTEX
-        hdr.mtx->lock();
-#else
-        pthread_rwlock_wrlock(hdr.rwlock);
-#endif
+        write_lock();
         // If this node has a sibling node,
         if (hdr.sibling_ptr && (hdr.sibling_ptr != NULL))
         {
@@ -410,11 +633,7 @@ public:
             {
                 if (with_lock)
                 {
-#ifdef MUTEX
-                    hdr.mtx->unlock(); // Unlock the write lock
-#else
-                    pthread_rwlock_unlock(hdr.rwlock);
-#endif
+                    write_unlock();
                 }
                 return ((page *)hdr.sibling_ptr)->remove(bt, key, true);
             }
@@ -422,11 +641,7 @@ public:
 
         bool ret = remove_key(key);
 
-#ifdef MUTEX
-        hdr.mtx->unlock();
-#else
-        pthread_rwlock_unlock(hdr.rwlock);
-#endif
+        write_unlock();
         return ret;
     }
 
@@ -490,21 +705,13 @@ public:
     {
         if (with_lock)
         {
-#ifdef MUTEX
-            hdr.mtx->lock(); // Lock the write lock
-#else
-            pthread_rwlock_wrlock(hdr.rwlock);
-#endif
+            write_lock();
         }
         if (hdr.is_deleted)
         {
             if (with_lock)
             {
-#ifdef MUTEX
-                hdr.mtx->unlock();
-#else
-                pthread_rwlock_unlock(hdr.rwlock);
-#endif
+                write_unlock();
             }
 
             return NULL;
@@ -518,7 +725,7 @@ public:
         //      {
         //          records[i].ptr = right;
         //          if (with_lock)
-        //              hdr.mtx->unlock();
+        //              write_unlock();
         //          return this;
         //      }
 
@@ -530,8 +737,7 @@ public:
             // {
             //     if (with_lock)
             //     {
-            //         // hdr.mtx->unlock(); // Unlock the write lock
-            //         pthread_rwlock_unlock(hdr.rwlock);
+            //         write_unlock();
             //     }
             //     return hdr.sibling_ptr->store(bt, key, right, with_lock, invalid_sibling);
             // }
@@ -540,11 +746,7 @@ public:
             {
                 if (with_lock)
                 {
-#ifdef MUTEX
-                    hdr.mtx->unlock(); // Unlock the write lock
-#else
-                    pthread_rwlock_unlock(hdr.rwlock);
-#endif
+                    write_unlock();
                 }
                 return ((page *)hdr.sibling_ptr)->store(bt, key, right, with_lock, invalid_sibling);
             }
@@ -557,11 +759,7 @@ public:
 
             if (with_lock)
             {
-#ifdef MUTEX
-                hdr.mtx->unlock(); // Unlock the write lock
-#else
-                pthread_rwlock_unlock(hdr.rwlock);
-#endif
+                write_unlock();
             }
 
             return this;
@@ -632,22 +830,14 @@ public:
 
                 if (with_lock)
                 {
-#ifdef MUTEX
-                    hdr.mtx->unlock(); // Unlock the write lock
-#else
-                    pthread_rwlock_unlock(hdr.rwlock);
-#endif
+                    write_unlock();
                 }
             }
             else
             {
                 if (with_lock)
                 {
-#ifdef MUTEX
-                    hdr.mtx->unlock(); // Unlock the write lock
-#else
-                    pthread_rwlock_unlock(hdr.rwlock);
-#endif
+                    write_unlock();
                 }
                 bt->btree_insert_internal(NULL, split_key, (char *)sibling,
                                           hdr.level + 1);
@@ -657,17 +847,68 @@ public:
         }
     }
 
+#ifndef STRING_KEY
+    // AVX2 versions of the loops of linear_search() and linear_search_last_level_pred(),
+    // 4 records per step in 2 vectors with the keys and pointers in alternate lanes. The
+    // loops pass over a pointer left in two records by a shift, which a read validated
+    // against the page version never sees, so the vectors compare the keys only.
+
+    // bit 2j: the key of e[j] is greater than key, bit 2j + 1: the pointer of e[j] is NULL
+    __attribute__((target("avx2"))) static int stop_mask_avx2(entry *e, __m256i key_32B)
+    {
+        __m256i cur = _mm256_loadu_si256((const __m256i *)e);
+        __m256i cmp = _mm256_blend_epi32(_mm256_cmpgt_epi64(cur, key_32B), _mm256_cmpeq_epi64(cur, _mm256_setzero_si256()), 0xcc);
+        return _mm256_movemask_pd(_mm256_castsi256_pd(cmp));
+    }
+
+    // the first record from 1 on with a NULL pointer or a key greater than key
+    __attribute__((target("avx2"))) int forward_stop_avx2(entry_key_t key)
+    {
+        __m256i key_32B = _mm256_set1_epi64x(key);
+        int i;
+        for (i = 1; i + 4 <= cardinality; i += 4)
+        {
+            int stop = stop_mask_avx2(&records[i], key_32B) | stop_mask_avx2(&records[i + 2], key_32B) << 4;
+            if (stop)
+                return i + (__builtin_ctz(stop) >> 1);
+        }
+        for (; i < cardinality; i++)
+            if (records[i].ptr == NULL || key < records[i].key)
+                break;
+        return i;
+    }
+
+    // the last of the first n records with a key not greater than key, -1 if none
+    __attribute__((target("avx2"))) int backward_stop_avx2(entry_key_t key, int n)
+    {
+        __m256i key_32B = _mm256_set1_epi64x(key);
+        int i;
+        for (i = n - 4; i >= 0; i -= 4)
+        {
+            int le = ~(stop_mask_avx2(&records[i], key_32B) | stop_mask_avx2(&records[i + 2], key_32B) << 4) & 0x55;
+            if (le)
+                return i + ((31 - __builtin_clz(le)) >> 1);
+        }
+        for (i += 3; i >= 0; i--)
+            if (key >= records[i].key)
+                break;
+        return i;
+    }
+#endif
+
     char *
     linear_search(entry_key_t key)
     {
         int i = 1;
         uint8_t previous_switch_counter;
+        uint64_t version;
         char *ret = NULL;
         char *t;
         entry_key_t k;
         { // internal node
             do
             {
+                version = read_version();
                 previous_switch_counter = hdr.switch_counter;
                 ret = NULL;
 
@@ -682,6 +923,13 @@ public:
                         }
                     }
 
+#ifndef STRING_KEY
+                    if (simd_level >= SIMD_AVX2)
+                    {
+                        ret = records[forward_stop_avx2(key) - 1].ptr;
+                        continue;
+                    }
+#endif
                     for (i = 1; records[i].ptr != NULL; ++i)
                     {
                         if (key < (k = records[i].key))
@@ -702,6 +950,14 @@ public:
                 }
                 else
                 { // search from right to left
+#ifndef STRING_KEY
+                    if (simd_level >= SIMD_AVX2)
+                    {
+                        i = backward_stop_avx2(key, count());
+                        ret = i == -1 ? NULL : records[i].ptr;
+                        continue;
+                    }
+#endif
                     for (i = count() - 1; i >= 0; --i)
                     {
                         if (key >= (k = records[i].key))
@@ -725,7 +981,7 @@ public:
                         }
                     }
                 }
-            } while (hdr.switch_counter != previous_switch_counter);
+            } while (hdr.switch_counter != previous_switch_counter || !validate_version(version));
 
             if ((t = (char *)hdr.sibling_ptr) != NULL)
             {
@@ -745,7 +1001,9 @@ public:
     }
 
     // op_type: 0 indicates insert operations and 1 indicates search operations.
-    char *linear_search_last_level_pred(entry_key_t key, uint8_t op_type, uint8_t &version, bnode **pred)
+    // upper: if not NULL, set to the smallest key routed to the bnodes after the returned one
+    // lower: if not NULL, set to the smallest key routed to the returned bnode
+    char *linear_search_last_level_pred(entry_key_t key, uint8_t op_type, uint8_t &version, bnode **pred, entry_key_t *upper = NULL, entry_key_t *lower = NULL)
     {
         int i = 1;
         uint8_t previous_switch_counter;
@@ -754,9 +1012,11 @@ public:
         entry_key_t k;
 
         int index = -1;
+        uint64_t page_version;
 
     retry:
 
+        page_version = read_version();
         previous_switch_counter = hdr.switch_counter;
         ret = NULL;
 
@@ -773,6 +1033,14 @@ public:
                 }
             }
 
+#ifndef STRING_KEY
+            if (simd_level >= SIMD_AVX2)
+            {
+                index = forward_stop_avx2(key) - 1;
+                ret = records[index].ptr;
+                goto find;
+            }
+#endif
             for (i = 1; records[i].ptr != NULL; ++i)
             {
                 if (key < (k = records[i].key))
@@ -797,6 +1065,14 @@ public:
         }
         else
         { // search from right to left
+#ifndef STRING_KEY
+            if (simd_level >= SIMD_AVX2)
+            {
+                index = backward_stop_avx2(key, count());
+                ret = index == -1 ? (char *)hdr.leftmost_ptr : records[index].ptr;
+                goto find;
+            }
+#endif
             for (i = count() - 1; i >= 0; --i)
             {
                 if (key >= (k = records[i].key))
@@ -839,7 +1115,12 @@ public:
 
         _mm_mfence();
 
-        if (hdr.switch_counter != previous_switch_counter || (index < count() - 1 && key >= records[index + 1].key))
+        if (upper)
+            *upper = (index < count() - 1) ? records[index + 1].key : (hdr.sibling_ptr ? ((page *)hdr.sibling_ptr)->hdr.minkey : LONG_MAX);
+        if (lower)
+            *lower = (index >= 0) ? records[index].key : hdr.minkey;
+
+        if (hdr.switch_counter != previous_switch_counter || !validate_version(page_version) || (index < count() - 1 && key >= records[index + 1].key))
         {
             reset_lock_bnode((bnode *)ret, op_type);
             goto retry;
@@ -853,7 +1134,7 @@ public:
             if (key >= ((page *)hdr.sibling_ptr)->hdr.minkey)
             {
                 reset_lock_bnode((bnode *)ret, op_type);
-                return ((page *)hdr.sibling_ptr)->linear_search_last_level_pred(key, op_type, version, pred);
+                return ((page *)hdr.sibling_ptr)->linear_search_last_level_pred(key, op_type, version, pred, upper, lower);
             }
         }
 
@@ -924,21 +1205,95 @@ lnode *alloc_lnode()
 {
     count_lnode_group[thread_id]++;
 
-    return (lnode *)nvmpool_alloc(sizeof(lnode));
+    return (lnode *)nvmpool_alloc_node(sizeof(lnode));
+}
+
+static void free_lnode(void *p)
+{
+    nvmpool_free_node(p);
 }
 
 void dealloc_lnode(lnode *ln)
 {
     count_lnode_group[thread_id]--;
-    nvmpool_free(ln);
+    epoch_retire(ln, free_lnode);
+}
+
+#ifdef STRING_KEY
+// The bodies of the keys in the tree are packed into chunks of the size of a leaf node,
+// so that the NVM pool of a thread still serves nodes of one size. A chunk is not freed
+// before a restart, whose recovery keeps the chunks of the keys in leaf nodes and logs.
+inline thread_local char *key_chunk_cur, *key_chunk_end;
+
+// the key of the tree for key, with its body copied to NVM
+static entry_key_t persist_key(entry_key_t key)
+{
+    if (key.in_nvm())
+        return key;
+
+    int size = sizeof(str_key_body) + key.body()->len;
+    if (key_chunk_cur + size > key_chunk_end)
+    {
+        key_chunk_cur = (char *)nvmpool_alloc_node(sizeof(lnode));
+        key_chunk_end = key_chunk_cur + sizeof(lnode);
+    }
+    str_key_body *p = (str_key_body *)key_chunk_cur;
+    memcpy(p, key.body(), size);
+    clflush(p, size);
+    key_chunk_cur += size;
+    return key.moved_to(p);
 }
+#endif
+
+// Readers and writers do not lock the inodes, so the leaf nodes and bnodes unlinked by
+// a merge are freed once no operation can hold them. The guards of a thread nest, e.g.
+// the operations of a coro_scheduler, and the thread leaves the epoch with the last one.
+inline thread_local int epoch_depth;
+struct epoch_guard
+{
+    epoch_guard()
+    {
+        if (epoch_depth++ == 0)
+            epoch_enter(thread_id);
+    }
+    ~epoch_guard()
+    {
+        if (--epoch_depth == 0)
+            epoch_exit(thread_id);
+    }
+};
 
 std::future<void> bg_thread;
 volatile bool signal_run_bgthread;
 
+// split [0, n) into num_threads ranges and run fn(tid, from, to) on each of them.
+template <typename F>
+void run_in_parallel(uint64_t n, F fn)
+{
+    std::vector<std::future<void>> futures;
+    uint64_t per_thread = (n + num_threads - 1) / num_threads;
+    for (uint64_t tid = 0; tid < num_threads; tid++)
+    {
+        uint64_t from = per_thread * tid;
+        uint64_t to = std::min(n, from + per_thread);
+        if (from >= to)
+            break;
+        futures.push_back(std::async(
+            std::launch::async, [&fn](uint64_t from, uint64_t to, uint64_t tid)
+            {
+                worker_id = tid;
+                thread_id = tid;
+                fn(tid, from, to); },
+            from, to, tid));
+    }
+    for (auto &&f : futures)
+        f.get();
+}
+
 __thread int count_add_log = 0;
-inline void insert_into_logs(uint64_t key, uint64_t ptr, bool gc)
+inline void insert_into_logs(entry_key_t k, uint64_t ptr, bool gc)
 {
+    uint64_t key = key_raw(k);
     if (!gc)
     {
 #ifdef NUMA_TEST
@@ -947,7 +1302,7 @@ inline void insert_into_logs(uint64_t key, uint64_t ptr, bool gc)
         add_log(key, ptr);
 #endif
         count_add_log++;
-        if ((count_add_log % 10000 == 0) && signal_do_recycle == false)
+        if ((count_add_log % LOG_RECYCLE_CHECK_INTERVAL == 0) && signal_do_recycle == false)
         {
             if (if_log_recycle())
             {
@@ -955,6 +1310,7 @@ inline void insert_into_logs(uint64_t key, uint64_t ptr, bool gc)
                 if (__sync_bool_compare_and_swap(&signal_do_recycle, false, true))
                 {
                     // printf("signal_do_recycle = %d\n", signal_do_recycle);
+                    bg_wake();
                 }
                 // signal_do_recycle = true;
             }
@@ -975,25 +1331,41 @@ inline void insert_into_logs(uint64_t key, uint64_t ptr, bool gc)
 /*
  * class btree
  */
-btree::btree()
+btree::btree(bool is_recovery)
 {
+    epoch_num = 0;
+    lnode_size = sizeof(lnode);
+    memset(&gc_stats, 0, sizeof(gc_stats_t));
 
-    first_inode = new page(); // level=0;
-    root = (char *)first_inode;
+    signal_do_recycle = false;
 
-    height = 0;
+    if (is_recovery)
+    {
+        recover();
+    }
+    else
+    {
+        first_inode = new page(); // level=0;
+        root = (char *)first_inode;
 
-    bnode *first_bnode = alloc_bnode();
-    first_lnode = alloc_lnode();
+        height = 0;
 
-    first_bnode->meta.v.ptr = (uint64_t)first_lnode;
-    first_inode->hdr.leftmost_ptr = (uint64_t)first_bnode;
+        bnode *first_bnode = alloc_bnode();
+        first_lnode = alloc_lnode();
 
-    first_lnode->meta.bitmap = 1; // Insert (0,0) as a minimum kv to prevent the deletion of the first leaf node.
+        first_bnode->meta.v.ptr = (uint64_t)first_lnode;
+        first_inode->hdr.leftmost_ptr = (uint64_t)first_bnode;
 
-    epoch_num = 0;
+        first_lnode->ch(0) = TOMBSTONE;
+        first_lnode->meta.bitmap = 1; // Insert (0,TOMBSTONE) as a minimum kv to prevent the deletion of the first leaf node.
+        clflush(first_lnode, sizeof(lnode));
 
-    signal_do_recycle = false;
+#ifndef NUMA_TEST
+        treeRoot *r = (treeRoot *)the_thread_nvmpools.get_root();
+        r->first_lnode = (uint64_t)first_lnode;
+        clflush(r, sizeof(treeRoot));
+#endif
+    }
 
     signal_run_bgthread = true;
     _mm_mfence();
@@ -1007,6 +1379,7 @@ btree::btree()
             worker_id = num_threads;
             thread_id = num_threads;
 
+            uint64_t gc_check = NowNanos();
             while (signal_run_bgthread)
             {
                 // printf("%d\n",signal_do_recycle);
@@ -1014,6 +1387,20 @@ btree::btree()
                 {
                     recycle_bottom();
                 }
+#ifndef NUMA_TEST
+                if (log_commit_window)
+                {
+                    log_commit_expired();
+                }
+#endif
+                // sleep until a writer asks for GC or the next timer expires
+                bg_wait(bg_timeout_ns());
+                if (BG_GC_INTERVAL_MS && ElapsedNanos(gc_check) >= BG_GC_INTERVAL_MS * 1000000ULL)
+                {
+                    gc_check = NowNanos();
+                    if (signal_do_recycle == false && if_log_recycle())
+                        signal_do_recycle = true;
+                }
             } });
 }
 
@@ -1028,35 +1415,78 @@ void btree::setNewRoot(char *new_root)
     ++height;
 }
 
-static inline unsigned char hashcode1B(key_type_sob x)
+static inline unsigned char hashcode1B(entry_key_t k)
 {
+#ifdef STRING_KEY
+    return k.fgpt();
+#else
+    int64_t x = k;
     x ^= x >> 32;
     x ^= x >> 16;
     x ^= x >> 8;
     return (unsigned char)(x & 0x0ffULL);
+#endif
 }
 
-// return -1 if not find
-inline int search_from_lnode(unsigned char key_hash, lnode *ln, key_type_sob key)
+// The slots in bitmap whose fingerprint in fgpt is key_hash. The padding fingerprints
+// are cleared by the bitmap.
+static inline uint64_t fgpt_match_sse(unsigned char key_hash, const unsigned char *fgpt, uint64_t bitmap)
 {
-
-    // SIMD comparison
     // a. set every byte to key_hash in a 16B register
     __m128i key_16B = _mm_set1_epi8((char)key_hash);
 
-    // b. load meta into another 16B register
-    __m128i fgpt_16B = _mm_load_si128((const __m128i *)(ln->meta.fgpt));
+    uint64_t mask = 0;
+    for (int v = 0; v < leaf_geometry::fgpt_vectors; v++)
+    {
+        // b. load 16 fingerprints into another 16B register
+        __m128i fgpt_16B = _mm_load_si128((const __m128i *)(fgpt + 16 * v));
+
+        // c. compare them
+        __m128i cmp_res = _mm_cmpeq_epi8(key_16B, fgpt_16B);
+
+        // d. generate a mask
+        mask |= (uint64_t)(unsigned int)_mm_movemask_epi8(cmp_res) << (16 * v); // 1: same; 0: diff
+    }
+    return mask & bitmap;
+}
+
+// 32 fingerprints per compare, for leaf nodes of 512 bytes or more
+__attribute__((target("avx2"))) static inline uint64_t fgpt_match_avx2(unsigned char key_hash, const unsigned char *fgpt, uint64_t bitmap)
+{
+    __m256i key_32B = _mm256_set1_epi8((char)key_hash);
+    uint64_t mask = 0;
+    for (int v = 0; v < leaf_geometry::fgpt_size / 32; v++)
+    {
+        __m256i cmp_res = _mm256_cmpeq_epi8(key_32B, _mm256_loadu_si256((const __m256i *)(fgpt + 32 * v)));
+        mask |= (uint64_t)(unsigned int)_mm256_movemask_epi8(cmp_res) << (32 * v);
+    }
+    return mask & bitmap;
+}
 
-    // c. compare them
-    __m128i cmp_res = _mm_cmpeq_epi8(key_16B, fgpt_16B);
+// one compare under the bitmap as its mask register
+__attribute__((target("avx512bw,avx512vl"))) static inline uint64_t fgpt_match_avx512(unsigned char key_hash, const unsigned char *fgpt, uint64_t bitmap)
+{
+    if constexpr (leaf_geometry::fgpt_size == 16)
+        return _mm_mask_cmpeq_epi8_mask((__mmask16)bitmap, _mm_set1_epi8((char)key_hash), _mm_load_si128((const __m128i *)fgpt));
+    else if constexpr (leaf_geometry::fgpt_size == 32)
+        return _mm256_mask_cmpeq_epi8_mask((__mmask32)bitmap, _mm256_set1_epi8((char)key_hash), _mm256_loadu_si256((const __m256i *)fgpt));
+    else
+        return _mm512_mask_cmpeq_epi8_mask(bitmap, _mm512_set1_epi8((char)key_hash), _mm512_loadu_si512(fgpt));
+}
 
-    // d. generate a mask
-    unsigned int mask = (unsigned int)
-        _mm_movemask_epi8(cmp_res); // 1: same; 0: diff
+static inline uint64_t fgpt_match(unsigned char key_hash, lnode *ln)
+{
+    if (simd_level == SIMD_AVX512)
+        return fgpt_match_avx512(key_hash, ln->meta.fgpt, ln->meta.bitmap);
+    if (leaf_geometry::fgpt_size >= 32 && simd_level == SIMD_AVX2)
+        return fgpt_match_avx2(key_hash, ln->meta.fgpt, ln->meta.bitmap);
+    return fgpt_match_sse(key_hash, ln->meta.fgpt, ln->meta.bitmap);
+}
 
-    // remove the lower 2 bits then AND bitmap
-    // mask = (mask >> 2) & ((unsigned int)(ln->meta.bitmap));
-    mask = mask & ((unsigned int)(ln->meta.bitmap)); // note : the higher 2 bits need to clear.
+// return -1 if not find
+inline int search_from_lnode(unsigned char key_hash, lnode *ln, entry_key_t key)
+{
+    uint64_t mask = fgpt_match(key_hash, ln);
 
     // search every matching candidate
     while (mask)
@@ -1068,15 +1498,49 @@ inline int search_from_lnode(unsigned char key_hash, lnode *ln, key_type_sob key
             return jj;
         }
 
-        mask &= ~(0x1 << jj); // remove this bit
+        mask &= ~(1ULL << jj); // remove this bit
     }                         // end while
 
     return -1;
 }
 
-bnode *btree::get_the_target_bnode(entry_key_t key, uint8_t op_type, bnode **pred, page **inode)
+#ifndef STRING_KEY
+// The cached kvs of bn whose key is key, as a bitmap. A vector holds the keys and values
+// of 4 kvs, the values are masked out.
+__attribute__((target("avx512f,bmi2"))) static inline uint32_t cache_match_avx512(bnode *bn, entry_key_t key)
 {
-    page *p = (page *)root;
+    __m512i key_64B = _mm512_set1_epi64(key);
+    uint32_t mask = 0;
+    for (int i = 0; i < CACHE_KEY_NUM; i += 4)
+    {
+        // the keys of the kvs left, the masked-out lanes are not loaded
+        __mmask8 keys = 0x55 & ((1U << 2 * std::min(4, CACHE_KEY_NUM - i)) - 1);
+        __mmask8 m = _mm512_mask_cmpeq_epi64_mask(keys, key_64B, _mm512_maskz_loadu_epi64(keys, &bn->cache[i]));
+        mask |= _pext_u32(m, 0x55) << i;
+    }
+    return mask;
+}
+#endif
+
+// return the first of the n cached kvs of bn that holds key, -1 if none
+static inline int cache_find(bnode *bn, entry_key_t key, int n = CACHE_KEY_NUM)
+{
+#ifndef STRING_KEY
+    // below 4 kvs, and with AVX2 compares, the scalar loop is as fast
+    if (CACHE_KEY_NUM >= 4 && simd_level == SIMD_AVX512)
+        return bitScan(cache_match_avx512(bn, key) & ((1U << n) - 1)) - 1;
+#endif
+    for (int i = 0; i < n; i++)
+        if (bn->cache[i].k == key)
+            return i;
+    return -1;
+}
+
+// from is a last-level page to start from instead of the root if key is not left of it.
+// The last-level pages are never freed and only give keys to their siblings.
+bnode *btree::get_the_target_bnode(entry_key_t key, uint8_t op_type, bnode **pred, page **inode, entry_key_t *upper, page *from, entry_key_t *lower)
+{
+    page *p = (from && key >= from->hdr.minkey) ? from : (page *)root;
 
     while (p->hdr.level != 0)
     {
@@ -1085,7 +1549,7 @@ bnode *btree::get_the_target_bnode(entry_key_t key, uint8_t op_type, bnode **pre
 
     page *t;
     uint8_t previous_verion;
-    while ((t = (page *)p->linear_search_last_level_pred(key, op_type, previous_verion, pred)) == (page *)(p->hdr.sibling_ptr))
+    while ((t = (page *)p->linear_search_last_level_pred(key, op_type, previous_verion, pred, upper, lower)) == (page *)(p->hdr.sibling_ptr))
     {
         p = t;
         if (!p)
@@ -1120,9 +1584,19 @@ void btree::btree_insert_internal(char *left, entry_key_t key, char *right, uint
     }
 }
 
+// Return NULL if key is not in the tree, see search(key, val) for a NULL value.
 char *btree::search(entry_key_t key)
 {
+    char *val;
+    return search(key, &val) ? val : NULL;
+}
+
+// Return false if key is not in the tree, otherwise its value is in *val.
+bool btree::search(entry_key_t key, char **val)
+{
+    epoch_guard guard;
 
+retry:
     page *inode = NULL;
     bnode *bn = get_the_target_bnode(key, 1, NULL, &inode);
 
@@ -1131,12 +1605,12 @@ char *btree::search(entry_key_t key)
 
     // 2.5 search cache
     {
-        // sequential search (which is slightly faster now)
-        for (int i = 0; i < CACHE_KEY_NUM; i++)
-            if (key == bn->cache[i].k)
-            {
-                return bn->cache[i].v;
-            }
+        int i = cache_find(bn, key);
+        if (i != -1)
+        {
+            *val = bn->cache[i].v;
+            return *val != TOMBSTONE;
+        }
     }
 
     // 3. search leaf node
@@ -1146,46 +1620,246 @@ char *btree::search(entry_key_t key)
 
     if (previous_verion == bn->meta.v.version)
     {
-        return ret_pos == -1 ? NULL : ln->ch(ret_pos);
+        *val = ret_pos == -1 ? TOMBSTONE : ln->ch(ret_pos);
+        return *val != TOMBSTONE;
     }
     else
     {
-        return search(key);
+        goto retry;
     }
 }
 
-bool btree::insert(entry_key_t key, char *val, bool update)
+static inline void pref_page(page *p)
 {
+    for (int i = 0; i < PAGESIZE; i += CACHE_LINE_SIZE)
+        pref(*((char *)p + i));
+}
 
-    bnode *bnode_sibp = NULL;
-    page *parent = NULL;
-    bnode *bn = get_the_target_bnode(key, 0, &bnode_sibp, &parent);
-
-    short cpos = -1;
-
-    int i, b;
-    uint8_t version;
-
-    // search the buffer node
-
-    cpos = bn->meta.v.counter;
-    for (b = 0; b < bn->meta.v.counter; b++)
+// Search keys[0..n) into vals[0..n) and found[0..n) as search() does, a key not in the
+// tree gets TOMBSTONE. The lookups of a group run every step in turn, so the misses on
+// the pages, the bnodes and the leaf nodes of a group overlap.
+void btree::multi_get(entry_key_t *keys, int n, char **vals, bool *found)
+{
+    page *p[MULTI_GET_GROUP];
+    bnode *bn[MULTI_GET_GROUP];
+    lnode *ln[MULTI_GET_GROUP];
+    uint8_t version[MULTI_GET_GROUP];
+    bool done[MULTI_GET_GROUP];
+    page *inode;
+    int i, j, m, left;
+
+    for (; n > 0; n -= m, keys += m, vals += m, found += m)
     {
-        if (bn->cache[b].k == key)
+        m = std::min(n, MULTI_GET_GROUP);
         {
-            if (update) // update operation, overwrite the target kv.
+            epoch_guard guard;
+
+            // 1. inner pages, one step of every lookup at a time
+            for (i = 0; i < m; i++)
+                p[i] = (page *)root;
+            do
             {
-                cpos = b;
-                break;
+                left = 0;
+                for (i = 0; i < m; i++)
+                    if (p[i]->hdr.level != 0)
+                    {
+                        p[i] = (page *)p[i]->linear_search(keys[i]);
+                        pref_page(p[i]);
+                        left++;
+                    }
+            } while (left);
+
+            // 2. the bnodes in the last-level pages
+            for (i = 0; i < m; i++)
+            {
+                bn[i] = get_the_target_bnode(keys[i], 1, NULL, &inode, NULL, p[i]);
+                pref(*bn[i]);
             }
-            else // find the key, just return
+
+            // 3. the caches of the bnodes, then the leaf nodes of the kvs not cached
+            for (i = 0; i < m; i++)
             {
-                reset_lock_bnode(bn, 0);
+                version[i] = bn[i]->meta.v.version;
+                done[i] = false;
+                if (IS_LOCKED(version[i]))
+                    continue;
+                j = cache_find(bn[i], keys[i]);
+                if (j != -1)
+                {
+                    vals[i] = bn[i]->cache[j].v;
+                    done[i] = true;
+                }
+                ln[i] = (lnode *)bn[i]->meta.v.ptr;
+                if (!done[i])
+                    pref_lnode(ln[i]);
+            }
 
-                return true;
+            // 4. the fingerprints of the leaf nodes
+            for (i = 0; i < m; i++)
+            {
+                if (!done[i] && !IS_LOCKED(version[i]))
+                {
+                    j = search_from_lnode(hashcode1B(keys[i]), ln[i], keys[i]);
+                    vals[i] = j == -1 ? TOMBSTONE : ln[i]->ch(j);
+                }
+                done[i] = version[i] == bn[i]->meta.v.version && !IS_LOCKED(version[i]);
             }
         }
+
+        // a bnode changed under its lookup
+        for (i = 0; i < m; i++)
+            found[i] = done[i] ? vals[i] != TOMBSTONE : search(keys[i], &vals[i]);
+    }
+}
+
+#ifdef __cpp_impl_coroutine
+// The operations below run in a coro_scheduler. They suspend after every prefetch on
+// the path of key, see multi_get() for the steps.
+
+coro_task btree::search_coro(entry_key_t key, char **val, bool *found)
+{
+    epoch_guard guard;
+    page *p, *inode;
+    bnode *bn;
+    lnode *ln;
+    uint8_t version;
+    int i;
+
+    while (true)
+    {
+        p = (page *)root;
+        while (p->hdr.level != 0)
+        {
+            p = (page *)p->linear_search(key);
+            pref_page(p);
+            co_await coro_yield{};
+        }
+        bn = get_the_target_bnode(key, 1, NULL, &inode, NULL, p);
+        pref(*bn);
+        co_await coro_yield{};
+
+        version = bn->meta.v.version;
+        if (IS_LOCKED(version))
+            continue;
+        i = cache_find(bn, key);
+        if (i != -1)
+        {
+            *val = bn->cache[i].v;
+        }
+        else
+        {
+            ln = (lnode *)bn->meta.v.ptr;
+            pref_lnode(ln);
+            co_await coro_yield{};
+            i = search_from_lnode(hashcode1B(key), ln, key);
+            *val = i == -1 ? TOMBSTONE : ln->ch(i);
+        }
+        if (version == bn->meta.v.version)
+        {
+            *found = *val != TOMBSTONE;
+            co_return;
+        }
+    }
+}
+
+// Prefetch the path of key, then insert it with insert().
+coro_task btree::insert_coro(entry_key_t key, char *val, bool update)
+{
+    epoch_guard guard;
+    page *p, *inode;
+    bnode *bn;
+
+    p = (page *)root;
+    while (p->hdr.level != 0)
+    {
+        p = (page *)p->linear_search(key);
+        pref_page(p);
+        co_await coro_yield{};
+    }
+    bn = get_the_target_bnode(key, 1, NULL, &inode, NULL, p);
+    pref(*bn);
+    co_await coro_yield{};
+    pref_lnode((lnode *)bn->meta.v.ptr);
+    co_await coro_yield{};
+
+    insert(key, val, update);
+}
+#endif
+
+// A value TOMBSTONE deletes key. With merge, val is merge(the value of key, operand),
+// computed under the bnode lock, and the value before is put in *old. Return false if
+// nothing is written: key is found with update false, or merge returns the value.
+bool btree::insert(entry_key_t key, char *val, bool update, merge_fn merge, char *operand, char **old)
+{
+    epoch_guard guard;
+
+    bnode *bnode_sibp = NULL;
+    page *parent = NULL;
+    bnode *bn = get_the_target_bnode(key, 0, &bnode_sibp, &parent);
+
+    short cpos = -1;
+
+    int i, b;
+    uint8_t version;
+
+    // search the buffer node
+
+    cpos = bn->meta.v.counter;
+    b = cache_find(bn, key, bn->meta.v.counter);
+    if (b != -1)
+    {
+        if (update || bn->cache[b].v == TOMBSTONE) // update operation, overwrite the target kv.
+        {
+            cpos = b;
+        }
+        else // find the key, just return
+        {
+            reset_lock_bnode(bn, 0);
+
+            return false;
+        }
+    }
+
+    if (merge)
+    {
+        char *cur;
+        if (cpos < bn->meta.v.counter)
+            cur = bn->cache[cpos].v;
+        else
+        {
+            lnode *ln = (lnode *)bn->meta.v.ptr;
+            int pos = search_from_lnode(hashcode1B(key), ln, key);
+            cur = (pos == -1) ? TOMBSTONE : ln->ch(pos);
+        }
+        if (old)
+            *old = cur;
+        val = merge(cur, operand);
+        if (val == cur)
+        {
+            reset_lock_bnode(bn, 0);
+            return false;
+        }
+    }
+
+#ifdef STRING_KEY
+    // store the body of the key found in the bnode or leaf node, or a copy in NVM
+    if (cpos < bn->meta.v.counter)
+        key = bn->cache[cpos].k;
+    else if (!key.in_nvm())
+    {
+        lnode *ln = (lnode *)bn->meta.v.ptr;
+        int pos = search_from_lnode(hashcode1B(key), ln, key);
+        if (pos != -1)
+            key = ln->k(pos);
+        else if (val == TOMBSTONE) // nothing to delete
+        {
+            reset_lock_bnode(bn, 0);
+            return false;
+        }
+        else
+            key = persist_key(key);
     }
+#endif
 
     if (cpos < CACHE_KEY_NUM) // update the buffer node without accessing the leaf node.
     {
@@ -1208,14 +1882,130 @@ bool btree::insert(entry_key_t key, char *val, bool update)
     }
     else // the buffer node is full, insert this kv into the leaf node.
     {
-        insert_into_leaf(bn, parent, key, val, update);
+        bool ret = insert_into_leaf(bn, parent, key, val, update);
 
         reset_lock_bnode(bn, 0);
 
-        return true;
+        return ret;
     }
 }
 
+// Set the value of key to fn(its value, operand) while its bnode is locked. A cached
+// key is updated in the bnode only.
+void btree::upsert_with(entry_key_t key, merge_fn fn, char *operand)
+{
+    insert(key, NULL, true, fn, operand);
+}
+
+// The conditional operations are merges that return the value they are given when the
+// condition does not hold, so that nothing is written or logged.
+static char *merge_if_absent(char *old, char *val)
+{
+    return (old == TOMBSTONE) ? val : old;
+}
+
+static char *merge_if_present(char *old, char *val)
+{
+    return (old == TOMBSTONE) ? old : val;
+}
+
+typedef struct cas_operand
+{
+    char *expected;
+    char *desired;
+} cas_operand;
+
+static char *merge_if_equal(char *old, char *operand)
+{
+    cas_operand *c = (cas_operand *)operand;
+    return (old == c->expected) ? c->desired : old;
+}
+
+// Return false if key is in the tree.
+bool btree::insert_if_absent(entry_key_t key, char *val)
+{
+    char *old;
+    insert(key, NULL, true, merge_if_absent, val, &old);
+    return old == TOMBSTONE;
+}
+
+// Return false if key is not in the tree.
+bool btree::update_if_present(entry_key_t key, char *val)
+{
+    char *old;
+    insert(key, NULL, true, merge_if_present, val, &old);
+    return old != TOMBSTONE;
+}
+
+// Set the value of key to desired if it is expected. Return false if it is not. An
+// expected or desired TOMBSTONE is an absent key.
+bool btree::compare_and_swap(entry_key_t key, char *expected, char *desired)
+{
+    char *old;
+    cas_operand c = {expected, desired};
+    insert(key, NULL, true, merge_if_equal, (char *)&c, &old);
+    return old == expected;
+}
+
+// Delete key. Return false if it is not in the tree.
+bool btree::erase(entry_key_t key)
+{
+    char *old;
+    insert(key, NULL, true, merge_if_present, TOMBSTONE, &old);
+    return old != TOMBSTONE;
+}
+
+#ifdef VALUE_HEAP
+static_assert(sizeof(lnode) % VHEAP_LINE == 0, "the value heap takes its lines from the pools of the leaf nodes");
+
+static char *merge_replace(char *old, char *val)
+{
+    return val;
+}
+
+// The blob of a replaced or deleted value may be reused only once the log entry of its
+// new handle is durable, or a crash inside the commit window would bring the key back
+// pointing at another value.
+static void retire_value(char *old)
+{
+#ifndef NUMA_TEST
+    if (log_commit_window)
+        log_commit();
+#endif
+    vheap_retire(old);
+}
+
+// The values of the value heap: the tree holds their handles, and a value replaced or
+// deleted is freed once no reader can hold it. A key is only written with these.
+void btree::put_value(entry_key_t key, const char *data, int len)
+{
+    char *old;
+    insert(key, NULL, true, merge_replace, vheap_put(data, len), &old);
+    if (old != TOMBSTONE)
+        retire_value(old);
+}
+
+// Copy the value of key into buf, return its length or -1 if key is not in the tree.
+int btree::get_value(entry_key_t key, char *buf)
+{
+    epoch_guard guard;
+    char *h;
+    if (!search(key, &h))
+        return -1;
+    return vheap_read(h, buf);
+}
+
+bool btree::erase_value(entry_key_t key)
+{
+    char *old;
+    insert(key, NULL, true, merge_if_present, TOMBSTONE, &old);
+    if (old == TOMBSTONE)
+        return false;
+    retire_value(old);
+    return true;
+}
+#endif
+
 bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val, bool update)
 {
     leaf_entry key_group[CACHE_KEY_NUM + 1];
@@ -1241,8 +2031,7 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
 
         if ((update == false) && (slot_id[0] != -1)) // find the target kv in the leaf node, just return.
         {
-            reset_lock_bnode(bn, 0);
-            return true;
+            return false;
         }
 
         key_group[0].k = key;
@@ -1264,16 +2053,37 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
 
 #ifdef TREE_NO_SELECLOG
     insert_into_logs(key, (uint64_t)val, false);
+#else
+    // deletes are logged for recovery, see replay_logs()
+    if (val == TOMBSTONE)
+        insert_into_logs(key, (uint64_t)val, false);
 #endif
 
+    // count the kvs left in ln
+    int remaining = ln->num();
+    for (int i = 0; i < CACHE_KEY_NUM + 1; i++)
+    {
+        if (key_group[i].v == TOMBSTONE && slot_id[i] != -1)
+            remaining--;
+        else if (key_group[i].v != TOMBSTONE && slot_id[i] == -1)
+            remaining++;
+    }
+
+    if (remaining <= LEAF_MERGE_NUM && merge_into_left_leaf(bn, parent, key_group, key_hash_group, slot_id))
+        return true;
+
+    // for a split, declared before the gotos
+    entry_key_t newkey;
+    char *newptr;
+
+    // The cached kvs in the buffer node also need to be divided into two parts.
+    leaf_entry old_cache[CACHE_KEY_NUM];
+    leaf_entry new_cache[CACHE_KEY_NUM];
+
     lnodeMeta meta;
     meta = ln->meta;
 
-    bool need_to_flush[4];
-    need_to_flush[0] = true;
-    need_to_flush[1] = false;
-    need_to_flush[2] = false;
-    need_to_flush[3] = false;
+    bool need_to_flush[LEAF_LINES] = {true};
 
     int index, slot;
 
@@ -1282,14 +2092,14 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
     {
         if (slot_id[index] != -1)
         {
-            if (key_group[index].v == 0) // delete
+            if (key_group[index].v == TOMBSTONE) // delete
             {
-                meta.bitmap &= (~(1 << slot_id[index]));
+                meta.bitmap &= (~(1ULL << slot_id[index]));
             }
             else // update
             {
                 ln->ent[slot_id[index]].v = key_group[index].v;
-                need_to_flush[(slot_id[index] + 2) / 4] = true;
+                need_to_flush[LEAF_LINE_OF(slot_id[index])] = true;
             }
         }
     }
@@ -1298,15 +2108,15 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
     // Splitting operations may be triggered.
     for (index = 0; index < CACHE_KEY_NUM + 1; index++)
     {
-        if (slot_id[index] == -1 && key_group[index].v != 0)
+        if (slot_id[index] == -1 && key_group[index].v != TOMBSTONE)
         {
-            if (meta.bitmap != 0x3fff)
+            if (meta.bitmap != LEAF_FULL_BITMAP)
             {
                 slot = bitScan(~meta.bitmap) - 1;
                 ln->ent[slot] = key_group[index];
                 meta.fgpt[slot] = key_hash_group[index];
-                meta.bitmap |= (1 << slot);
-                need_to_flush[(slot + 2) / 4] = true;
+                meta.bitmap |= (1ULL << slot);
+                need_to_flush[LEAF_LINE_OF(slot)] = true;
             }
             else
             {
@@ -1318,7 +2128,7 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
     {
     no_split_in_leaf_node:
         // flush the line containing slot and next pointer
-        for (int cacheline_number = 3; cacheline_number >= 1; cacheline_number--)
+        for (int cacheline_number = LEAF_LINES - 1; cacheline_number >= 1; cacheline_number--)
         {
             if (need_to_flush[cacheline_number])
                 clflush_nofence((char *)ln + cacheline_number * 64, CACHE_LINE_SIZE);
@@ -1326,7 +2136,7 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
 
         sfence();
 
-        meta.timestamp = _rdtsc();
+        meta.timestamp = log_now();
         ln->setMeta(&meta);
         clflush(ln, CACHE_LINE_SIZE);
 
@@ -1334,18 +2144,11 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
     }
 
     // The old leaf node will split.
-    key_type_sob newkey;
-    char *newptr;
-
-    // The cached kvs in the buffer node also need to be divided into two parts.
-    leaf_entry old_cache[CACHE_KEY_NUM];
-    leaf_entry new_cache[CACHE_KEY_NUM];
-
     {
     split_leaf_node:
 
         // get sorted positions
-        int timestamp = _rdtsc();
+        uint64_t timestamp = log_now();
         int sorted_pos[LEAF_KEY_NUM];
         for (int i = 0; i < LEAF_KEY_NUM; i++)
             sorted_pos[i] = i;
@@ -1360,7 +2163,7 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
 
         // split point is the middle point
         int split = (LEAF_KEY_NUM / 2); // [0,..split-1] [split,LEAF_KEY_NUM-1]
-        key_type_sob split_key = ln->k(sorted_pos[split]);
+        entry_key_t split_key = ln->k(sorted_pos[split]);
 
         // create new node
         lnode *newln = alloc_lnode();
@@ -1368,15 +2171,15 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
         newbn->meta.v.ptr = (uint64_t)newln;
 
         // 2.4 move entries sorted_pos[split .. LEAF_KEY_NUM-1]
-        uint16_t freed_slots = 0;
+        uint64_t freed_slots = 0;
         for (int i = split; i < LEAF_KEY_NUM; i++)
         {
             newln->ent[i] = ln->ent[sorted_pos[i]];
             newln->meta.fgpt[i] = meta.fgpt[sorted_pos[i]];
 
-            freed_slots |= (1 << sorted_pos[i]);
+            freed_slots |= (1ULL << sorted_pos[i]);
         }
-        newln->meta.bitmap = (((1 << (LEAF_KEY_NUM - split)) - 1) << split);
+        newln->meta.bitmap = (((1ULL << (LEAF_KEY_NUM - split)) - 1) << split);
         newln->meta.next = ln->meta.next;
         newln->meta.timestamp = timestamp;
 
@@ -1388,7 +2191,7 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
         // insert the remaining kvs to the new leaf node
         for (; index < CACHE_KEY_NUM + 1; index++)
         {
-            if (slot_id[index] == -1 && key_group[index].v != 0)
+            if (slot_id[index] == -1 && key_group[index].v != TOMBSTONE)
             {
                 // key > split_key: insert kvs into the new node
                 if (key_group[index].k >= split_key)
@@ -1396,7 +2199,7 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
                     slot = bitScan(~(newln->meta.bitmap)) - 1;
                     newln->ent[slot] = key_group[index];
                     newln->meta.fgpt[slot] = key_hash_group[index];
-                    newln->meta.bitmap |= (1 << slot);
+                    newln->meta.bitmap |= (1ULL << slot);
                 }
                 else
                 {
@@ -1409,7 +2212,7 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
         clflush(newln, sizeof(lnode));
 
         // persist the data region of the old leaf node
-        for (int cacheline_number = 3; cacheline_number >= 1; cacheline_number--)
+        for (int cacheline_number = LEAF_LINES - 1; cacheline_number >= 1; cacheline_number--)
         {
             if (need_to_flush[cacheline_number])
                 clflush_nofence((char *)ln + cacheline_number * 64, CACHE_LINE_SIZE);
@@ -1425,21 +2228,19 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
 
         // insert the remaining kvs to the old leaf nodes.
         {
+            memset(need_to_flush, 0, sizeof(need_to_flush));
             need_to_flush[0] = true;
-            need_to_flush[1] = false;
-            need_to_flush[2] = false;
-            need_to_flush[3] = false;
 
             for (index = 0; index < remaining_num; index++)
             {
                 slot = bitScan(~meta.bitmap) - 1;
                 ln->ent[slot] = key_group[remaining_index[index]];
                 meta.fgpt[slot] = key_hash_group[remaining_index[index]];
-                meta.bitmap |= (1 << slot);
-                need_to_flush[(slot + 2) / 4] = true;
+                meta.bitmap |= (1ULL << slot);
+                need_to_flush[LEAF_LINE_OF(slot)] = true;
             }
 
-            for (int cacheline_number = 3; cacheline_number >= 1; cacheline_number--)
+            for (int cacheline_number = LEAF_LINES - 1; cacheline_number >= 1; cacheline_number--)
             {
                 if (need_to_flush[cacheline_number])
                     clflush_nofence((char *)ln + cacheline_number * 64, CACHE_LINE_SIZE);
@@ -1473,152 +2274,575 @@ bool btree::insert_into_leaf(bnode *bn, page *parent, entry_key_t key, char *val
     }
 }
 
-#pragma GCC push_options
-#pragma GCC optimize("O0")
-inline void wait_for_lock(bnode *bn, uint8_t op_type, uint8_t &version)
+// search_from_lnode() against a meta region that is not written back yet
+static int search_in_meta(lnode *ln, lnodeMeta *meta, entry_key_t key)
 {
-    while (!get_lock_bnode(bn, op_type, version)) // bn has been locked, waitting.
+    unsigned char key_hash = hashcode1B(key);
+    for (int i = 0; i < LEAF_KEY_NUM; i++)
     {
-        ;
+        if ((meta->bitmap & (1ULL << i)) && meta->fgpt[i] == key_hash && ln->k(i) == key)
+            return i;
     }
+    return -1;
 }
-#pragma GCC pop_options
 
-void btree::recycle_bottom()
+// Apply kv (TOMBSTONE deletes it) to ln under the meta region meta. Return false if there is
+// no free slot for it.
+static bool write_into_lnode(lnode *ln, lnodeMeta *meta, leaf_entry kv, bool need_to_flush[LEAF_LINES])
 {
-// initialize new log files
-#ifdef NUMA_TEST
-    for (int i = 0; i < NUM_NUMA_NODE; i++)
+    int slot = search_in_meta(ln, meta, kv.k);
+    if (kv.v == TOMBSTONE)
     {
-        for (int j = 0; j <= num_threads; j++)
-        {
-            per_numa_log_pool[i].thread_log_pool[j].switch_alt_and_init();
-        }
+        if (slot != -1)
+            meta->bitmap &= (~(1ULL << slot));
+        return true;
     }
-#else
-    for (int i = 0; i <= num_threads; i++)
+    if (slot == -1)
     {
-        switch_alt_and_init(i);
+        if (meta->bitmap == LEAF_FULL_BITMAP)
+            return false;
+        slot = bitScan(~meta->bitmap) - 1;
+        ln->k(slot) = kv.k;
+        meta->fgpt[slot] = hashcode1B(kv.k);
+        meta->bitmap |= (1ULL << slot);
     }
-#endif
+    ln->ch(slot) = kv.v;
+    need_to_flush[LEAF_LINE_OF(slot)] = true;
+    return true;
+}
 
-    sfence();
-    epoch_num = 1 - epoch_num; // flip the global epoch
-    sfence();
+// Write the sorted kvs run[0..n) that are routed to one bnode in one locked section.
+// Return the number of kvs written, 0 if the leaf node has to split first.
+int btree::insert_run(leaf_entry *run, int n)
+{
+    epoch_guard guard;
 
-    page *current_inode = first_inode;
-    bnode *bn;
-    volatile bnode *bn_vo;
-    volatile bool ret;
-    uint8_t version;
+    page *parent = NULL;
+    entry_key_t upper;
+    bnode *bn = get_the_target_bnode(run[0].k, 0, NULL, &parent, &upper);
 
-    while (current_inode)
+    // the kvs of the same bnode, up to the first deletion
+    int m = 1;
+    while (m < n && run[m].v != TOMBSTONE && run[m].k < upper)
+        m++;
+
+    int i, b, index, slot;
+    int cpos[CACHE_KEY_NUM];
+    int counter = bn->meta.v.counter;
+
+    // 1. they fit into the free cache slots, buffer and log them as insert() does
+    if (m <= CACHE_KEY_NUM)
     {
-        /* leaf most ptr*/
-        if (current_inode->hdr.leftmost_ptr == NULL)
+        for (i = 0; i < m; i++)
         {
-            assert(false && "error,leafmost_ptr == NULL!");
+            for (b = 0; b < bn->meta.v.counter; b++)
+                if (bn->cache[b].k == run[i].k)
+                    break;
+            cpos[i] = (b < bn->meta.v.counter) ? b : counter++;
         }
 
-        /* get lock of bn*/
-        bn = (bnode *)current_inode->hdr.leftmost_ptr;
-        wait_for_lock(bn, 0, version);
-
-        for (int i_cache = 0; i_cache < bn->meta.v.counter; i_cache++)
+        if (counter <= CACHE_KEY_NUM)
         {
-            if (((bn->meta.v.epoch_num >> i_cache) & 1) != epoch_num)
+            for (i = 0; i < m; i++)
             {
-                insert_into_logs(bn->cache[i_cache].k, (uint64_t)bn->cache[i_cache].v, true);
+                bn->cache[cpos[i]] = run[i];
                 if (epoch_num)
-                    bn->meta.v.epoch_num |= (1 << i_cache);
+                    bn->meta.v.epoch_num |= (1ULL << cpos[i]);
                 else
-                    bn->meta.v.epoch_num &= (~(1 << i_cache));
+                    bn->meta.v.epoch_num &= (~(1ULL << cpos[i]));
+                insert_into_logs(run[i].k, (uint64_t)run[i].v, false);
             }
+            bn->meta.v.counter = counter;
+            reset_lock_bnode(bn, 0);
+            return m;
         }
+    }
 
-        reset_lock_bnode(bn, 0);
-
-        /* bn in records[] */
-        for (int i = 0; current_inode->records[i].ptr != NULL; i++)
-        {
-            /* get lock of bn*/
-            bn = (bnode *)current_inode->records[i].ptr;
-            wait_for_lock(bn, 0, version);
+    // 2. flush the cached kvs and the run into the leaf node
+    lnode *ln = (lnode *)bn->meta.v.ptr;
+    lnodeMeta meta = ln->meta;
 
-            for (int i_cache = 0; i_cache < bn->meta.v.counter; i_cache++)
-            {
-                if (((bn->meta.v.epoch_num >> i_cache) & 1) != epoch_num)
-                {
-                    insert_into_logs(bn->cache[i_cache].k, (uint64_t)bn->cache[i_cache].v, true);
-                    if (epoch_num)
-                        bn->meta.v.epoch_num |= (1 << i_cache);
-                    else
-                        bn->meta.v.epoch_num &= (~(1 << i_cache));
-                }
-            }
+    bool need_to_flush[LEAF_LINES] = {true};
 
-            reset_lock_bnode(bn, 0);
+    // the cached kvs and at least the first kv of the run must fit, so the leaf node is
+    // not left empty
+    uint64_t bitmap = meta.bitmap;
+    int new_slots = 0;
+    bool first_cached = false;
+    for (b = 0; b < bn->meta.v.counter; b++)
+    {
+        slot = search_from_lnode(hashcode1B(bn->cache[b].k), ln, bn->cache[b].k);
+        if (slot != -1 && bn->cache[b].v == TOMBSTONE) // delete
+            bitmap &= (~(1ULL << slot));
+        else if (slot == -1 && bn->cache[b].v != TOMBSTONE)
+            new_slots++;
+        if (bn->cache[b].k == run[0].k)
+        {
+            first_cached = true;
+            if (bn->cache[b].v == TOMBSTONE)
+                new_slots++;
         }
+    }
+    if (!first_cached && search_from_lnode(hashcode1B(run[0].k), ln, run[0].k) == -1)
+        new_slots++;
 
-        /* lock the next inode; */
-        current_inode = (page *)current_inode->hdr.sibling_ptr;
-    } // loop of inode
+    if (countBit(bitmap) + new_slots > LEAF_KEY_NUM)
+    {
+        reset_lock_bnode(bn, 0);
+        return 0;
+    }
 
 #ifdef NUMA_TEST
-    for (int i = 0; i < NUM_NUMA_NODE; i++)
+    (the_logpool.vlog_groups->flushed_count[the_logpool.vlog_groups->alt]) += bn->meta.v.counter;
+#else
+    (vlog_groups[thread_id]->flushed_count[vlog_groups[thread_id]->alt]) += bn->meta.v.counter;
+#endif
+
+    for (b = 0; b < bn->meta.v.counter; b++)
+        write_into_lnode(ln, &meta, bn->cache[b], need_to_flush);
+
+    for (index = 0; index < m; index++)
     {
-        per_numa_log_pool[i].collect_old_log_to_freelist();
+        if (!write_into_lnode(ln, &meta, run[index], need_to_flush))
+            break;
+#ifdef TREE_NO_SELECLOG
+        insert_into_logs(run[index].k, (uint64_t)run[index].v, false);
+#endif
     }
-#else
 
-    for (int i = 0; i <= num_threads; i++)
+    // a single flush of the leaf node
+    for (int cacheline_number = LEAF_LINES - 1; cacheline_number >= 1; cacheline_number--)
     {
-        collect_old_log_to_freelist(i);
+        if (need_to_flush[cacheline_number])
+            clflush_nofence((char *)ln + cacheline_number * 64, CACHE_LINE_SIZE);
     }
+    sfence();
 
-#endif // NUMA_TEST
+    meta.timestamp = log_now();
+    ln->setMeta(&meta);
+    clflush(ln, CACHE_LINE_SIZE);
 
-    signal_do_recycle = false;
+    // the cached kvs are kept for search, keep them up to date
+    for (b = 0; b < CACHE_KEY_NUM; b++)
+    {
+        slot = search_in_meta(ln, &meta, bn->cache[b].k);
+        bn->cache[b].v = (slot == -1) ? TOMBSTONE : ln->ch(slot);
+    }
+
+    bn->meta.v.counter = 0;
+    reset_lock_bnode(bn, 0);
+    return index;
 }
 
-thread_local std::vector<entry_key_t> key_in_bnode(CACHE_KEY_NUM);
-inline void get_range_key_from_lnode(bnode *bn, entry_key_t min_key, bool &if_find_a_small_key, int &off, std::vector<value_type_sob> &buf)
+// Insert or overwrite n kvs, a value TOMBSTONE deletes the key as in insert(). The batch is
+// sorted and every run of kvs routed to one bnode is written in one locked section, with
+// at most one flush of its leaf node. Splits and deletions go through insert().
+void btree::insert_batch(entry_key_t *keys, char **vals, int n)
 {
-    if (bn == NULL)
-        return;
-
-    uint8_t version;
-    int i;
-    lnode *ln;
+    std::vector<leaf_entry> batch(n);
+    for (int i = 0; i < n; i++)
+    {
+        batch[i].k = keys[i];
+        batch[i].v = vals[i];
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const leaf_entry &x, const leaf_entry &y)
+                     { return x.k < y.k; });
 
-    int old_off = off;
+    // the last kv of a key wins
+    int m = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (m > 0 && batch[m - 1].k == batch[i].k)
+            batch[m - 1] = batch[i];
+        else
+            batch[m++] = batch[i];
+    }
 
-retry:
-    wait_for_lock(bn, 1, version);
-    key_in_bnode.clear();
-    if_find_a_small_key = false;
-    off = old_off;
+#ifdef STRING_KEY
+    // insert_run() writes the keys as they are, insert() finds their bodies in NVM
+    for (int i = 0; i < m; i++)
+        insert(batch[i].k, batch[i].v, true);
+    return;
+#endif
 
-    // search cache
-    for (i = 0; i < bn->meta.v.counter; i++)
+    for (int i = 0; i < m;)
     {
-        if (bn->cache[i].k >= min_key)
+        int done = (batch[i].v == TOMBSTONE) ? 0 : insert_run(&batch[i], m - i);
+        if (done == 0) // fill the buffer until the leaf node splits, then batch again
         {
-            buf[off++] = (uint64_t)(bn->cache[i].v);
-            key_in_bnode.push_back(bn->cache[i].k);
+            for (; done < CACHE_KEY_NUM + 1 && i + done < m; done++)
+                insert(batch[i + done].k, batch[i + done].v, true);
         }
-        else
-            if_find_a_small_key = true;
+        i += done;
     }
-    // 3. search leaf node
-    ln = (lnode *)bn->meta.v.ptr;
-    for (i = 0; i < LEAF_KEY_NUM; i++)
-    {
-        if (ln->meta.bitmap & (1 << i))
-        {
-            if (ln->ent[i].k >= min_key)
-            {
-                if (std::find(key_in_bnode.begin(), key_in_bnode.end(), ln->ent[i].k) == key_in_bnode.end())
+}
+
+// Move the kvs of the leaf node of bn, with the kvs flushed from bn, into the leaf node of
+// its left sibling under the same inode, then unlink bn and its leaf node. bn is held by
+// the caller. Return false if there is no such sibling or it has no room left.
+bool btree::merge_into_left_leaf(bnode *bn, page *parent, leaf_entry *key_group, unsigned char *key_hash_group, int8_t *slot_id)
+{
+    lnode *ln = (lnode *)bn->meta.v.ptr;
+
+    parent->write_lock();
+
+    // bn may be in a sibling of parent, then it is not merged
+    int pos;
+    for (pos = 0; parent->records[pos].ptr != NULL; pos++)
+    {
+        if (parent->records[pos].ptr == (char *)bn)
+            break;
+    }
+    if (parent->records[pos].ptr == NULL)
+    {
+        parent->write_unlock();
+        return false;
+    }
+
+    bnode *bnode_sibp = (bnode *)(pos == 0 ? (char *)parent->hdr.leftmost_ptr : parent->records[pos - 1].ptr);
+    uint8_t version;
+    if (!get_lock_bnode(bnode_sibp, 0, version)) // do not wait, its writer may wait for parent
+    {
+        parent->write_unlock();
+        return false;
+    }
+
+    lnode *lnode_sibp = (lnode *)bnode_sibp->meta.v.ptr;
+    lnodeMeta meta = lnode_sibp->meta;
+    uint64_t bitmap = ln->meta.bitmap;
+    bool need_to_flush[LEAF_LINES] = {false};
+    int index, slot;
+
+    for (index = 0; index < CACHE_KEY_NUM + 1; index++)
+    {
+        if (slot_id[index] != -1)
+        {
+            if (key_group[index].v == TOMBSTONE) // delete
+                bitmap &= (~(1ULL << slot_id[index]));
+            else // update
+                ln->ent[slot_id[index]].v = key_group[index].v;
+        }
+    }
+
+    int moved = countBit(bitmap);
+    for (index = 0; index < CACHE_KEY_NUM + 1; index++)
+    {
+        if (slot_id[index] == -1 && key_group[index].v != TOMBSTONE)
+            moved++;
+    }
+    if (lnode_sibp->num() + moved > LEAF_MERGE_MAX)
+    {
+        reset_lock_bnode(bnode_sibp, 0);
+        parent->write_unlock();
+        return false;
+    }
+
+    // 1. write the kvs into free slots of the sibling, they are not visible yet
+    for (index = 0; index < LEAF_KEY_NUM; index++)
+    {
+        if (bitmap & (1ULL << index))
+        {
+            slot = bitScan(~meta.bitmap) - 1;
+            lnode_sibp->ent[slot] = ln->ent[index];
+            insert_into_logs(ln->ent[index].k, (uint64_t)ln->ent[index].v, false);
+            meta.fgpt[slot] = ln->meta.fgpt[index];
+            meta.bitmap |= (1ULL << slot);
+            need_to_flush[LEAF_LINE_OF(slot)] = true;
+        }
+    }
+
+    for (index = 0; index < CACHE_KEY_NUM + 1; index++)
+    {
+        if (slot_id[index] == -1 && key_group[index].v != TOMBSTONE)
+        {
+            slot = bitScan(~meta.bitmap) - 1;
+            lnode_sibp->ent[slot] = key_group[index];
+            insert_into_logs(key_group[index].k, (uint64_t)key_group[index].v, false);
+            meta.fgpt[slot] = key_hash_group[index];
+            meta.bitmap |= (1ULL << slot);
+            need_to_flush[LEAF_LINE_OF(slot)] = true;
+        }
+    }
+
+    for (int cacheline_number = LEAF_LINES - 1; cacheline_number >= 1; cacheline_number--)
+    {
+        if (need_to_flush[cacheline_number])
+            clflush_nofence((char *)lnode_sibp + cacheline_number * 64, CACHE_LINE_SIZE);
+    }
+
+    // The timestamp of the sibling still covers its own kvs, the moved kvs are logged
+    // again above and their newest entries win in recovery. They are durable before
+    // the kvs are published. The fingerprints of free slots are not read.
+#ifndef NUMA_TEST
+    log_commit();
+#endif
+    memcpy(lnode_sibp->meta.fgpt, meta.fgpt, sizeof(meta.fgpt));
+    sfence();
+
+    // 2. publish the kvs and unlink ln, at once if the bitmap and the pointer share one word
+    meta.next = ln->meta.next;
+    if constexpr (leaf_geometry::shared_word)
+        *(volatile uint64_t *)lnode_sibp = *(uint64_t *)&meta;
+    else
+        lnode_sibp->setMeta(&meta, true);
+    clflush(lnode_sibp, CACHE_LINE_SIZE);
+
+    // 3. route the key range of bn to the sibling
+    parent->remove_key(parent->records[pos].key);
+    parent->write_unlock();
+    reset_lock_bnode(bnode_sibp, 0);
+
+    dealloc_lnode(ln);
+    epoch_retire(bn, free);
+    return true;
+}
+
+#pragma GCC push_options
+#pragma GCC optimize("O0")
+inline void wait_for_lock(bnode *bn, uint8_t op_type, uint8_t &version)
+{
+    while (!get_lock_bnode(bn, op_type, version)) // bn has been locked, waitting.
+    {
+        ;
+    }
+}
+#pragma GCC pop_options
+
+// Log the cached kvs of bn that are not in the current epoch again.
+// Return false if wait is false and bn is held by a writer.
+static bool recycle_bnode(bnode *bn, int epoch_num, bool wait, gc_stats_t &stats)
+{
+    uint8_t version;
+    if (wait)
+        wait_for_lock(bn, 0, version);
+    else if (!get_lock_bnode(bn, 0, version))
+        return false;
+
+    for (int i_cache = 0; i_cache < bn->meta.v.counter; i_cache++)
+    {
+        if (((bn->meta.v.epoch_num >> i_cache) & 1) != epoch_num)
+        {
+            insert_into_logs(bn->cache[i_cache].k, (uint64_t)bn->cache[i_cache].v, true);
+            if (epoch_num)
+                bn->meta.v.epoch_num |= (1 << i_cache);
+            else
+                bn->meta.v.epoch_num &= (~(1 << i_cache));
+            stats.relogged++;
+        }
+    }
+
+    reset_lock_bnode(bn, 0);
+    return true;
+}
+
+// Recycle the bnodes of the inodes in [from, to) in slices of about GC_SLICE_BNODES
+// bnodes, yielding to the writers between slices. A bnode held by a writer is not
+// waited for, it is recycled after the range is done.
+void btree::recycle_range(page *from, page *to)
+{
+    gc_stats_t stats;
+    memset(&stats, 0, sizeof(gc_stats_t));
+    std::vector<bnode *> deferred;
+    epoch_guard guard; // the bnodes read from the inodes may be merged away
+
+    page *current_inode = from;
+    while (current_inode != to)
+    {
+        uint64_t slice_start = NowNanos();
+        uint64_t n = 0;
+        while (current_inode != to && n < GC_SLICE_BNODES)
+        {
+            // a merge shifts the records of the inode, read them under its version
+            bnode *bns[cardinality + 1];
+            int cnt;
+            page *next;
+            uint64_t version;
+            do
+            {
+                version = current_inode->read_version();
+                cnt = 0;
+                bnode *bn = (bnode *)current_inode->hdr.leftmost_ptr;
+                for (int i = 0; bn != NULL && i < cardinality; bn = (bnode *)current_inode->records[i++].ptr)
+                    bns[cnt++] = bn;
+                next = (page *)current_inode->hdr.sibling_ptr;
+            } while (!current_inode->validate_version(version));
+
+            if (cnt == 0)
+            {
+                assert(false && "error,leafmost_ptr == NULL!");
+            }
+
+            for (int i = 0; i < cnt; i++)
+            {
+                if (!recycle_bnode(bns[i], epoch_num, false, stats))
+                    deferred.push_back(bns[i]);
+            }
+            n += cnt;
+
+            current_inode = next;
+        }
+        uint64_t pause = ElapsedNanos(slice_start);
+        stats.slices++;
+        stats.bnodes += n;
+        stats.pause_tot_ns += pause;
+        stats.pause_max_ns = std::max(stats.pause_max_ns, pause);
+
+#ifndef NUMA_TEST
+        if (thread_id == num_threads && log_commit_window)
+        {
+            log_commit_expired();
+        }
+#endif
+        sched_yield();
+    }
+
+    for (bnode *bn : deferred)
+    {
+        recycle_bnode(bn, epoch_num, true, stats);
+    }
+    stats.deferred = deferred.size();
+
+    __sync_fetch_and_add(&gc_stats.slices, stats.slices);
+    __sync_fetch_and_add(&gc_stats.bnodes, stats.bnodes);
+    __sync_fetch_and_add(&gc_stats.relogged, stats.relogged);
+    __sync_fetch_and_add(&gc_stats.deferred, stats.deferred);
+    __sync_fetch_and_add(&gc_stats.pause_tot_ns, stats.pause_tot_ns);
+    uint64_t max_ns = gc_stats.pause_max_ns;
+    while (stats.pause_max_ns > max_ns && !__sync_bool_compare_and_swap(&gc_stats.pause_max_ns, max_ns, stats.pause_max_ns))
+        max_ns = gc_stats.pause_max_ns;
+}
+
+void btree::recycle_bottom()
+{
+    uint64_t gc_start = NowNanos();
+
+// initialize new log files
+#ifdef NUMA_TEST
+    for (int i = 0; i < NUM_NUMA_NODE; i++)
+    {
+        for (int j = 0; j <= num_threads; j++)
+        {
+            per_numa_log_pool[i].thread_log_pool[j].switch_alt_and_init();
+        }
+    }
+#else
+    for (int i = 0; i < num_log_groups; i++)
+    {
+        switch_alt_and_init(i);
+    }
+#endif
+
+    sfence();
+    epoch_num = 1 - epoch_num; // flip the global epoch
+    sfence();
+
+#ifdef NUMA_TEST
+    int gc_threads = 1; // the numa log pools have no log for the other GC threads
+#else
+    int gc_threads = GC_THREADS;
+#endif
+
+    if (gc_threads == 1)
+    {
+        recycle_range(first_inode, NULL);
+    }
+    else
+    {
+        // split the inode chain into key ranges with the same number of inodes.
+        // An inode split later lies after its left half, in the same range.
+        std::vector<page *> inodes;
+        for (page *p = first_inode; p; p = (page *)p->hdr.sibling_ptr)
+            inodes.push_back(p);
+
+        std::vector<page *> bounds(gc_threads + 1, NULL);
+        for (int i = 0; i < gc_threads; i++)
+            bounds[i] = inodes[inodes.size() * i / gc_threads];
+
+        // the background thread takes the first range and logs into its own log group,
+        // the others log into the groups after it.
+        std::vector<std::future<void>> futures;
+        for (int i = 1; i < gc_threads; i++)
+        {
+            if (bounds[i] == bounds[i + 1])
+                continue;
+            futures.push_back(std::async(
+                std::launch::async, [&](int i)
+                {
+                    worker_id = num_threads;
+                    thread_id = num_threads + i;
+                    recycle_range(bounds[i], bounds[i + 1]); },
+                i));
+        }
+        recycle_range(bounds[0], bounds[1]);
+        for (auto &&f : futures)
+            f.get();
+    }
+
+#ifdef NUMA_TEST
+    for (int i = 0; i < NUM_NUMA_NODE; i++)
+    {
+        per_numa_log_pool[i].collect_old_log_to_freelist();
+    }
+#else
+
+    for (int i = 0; i < num_log_groups; i++)
+    {
+        collect_old_log_to_freelist(i);
+    }
+
+#endif // NUMA_TEST
+
+    gc_stats.cycles++;
+    log_recycled(ElapsedNanos(gc_start));
+    signal_do_recycle = false;
+}
+
+void btree::print_gc_stats()
+{
+    printf("gc: %lu cycles, %lu slices, %lu bnodes, %lu kvs relogged, %lu bnodes deferred, pause avg %lu ns max %lu ns\n",
+           gc_stats.cycles, gc_stats.slices, gc_stats.bnodes, gc_stats.relogged, gc_stats.deferred,
+           gc_stats.slices ? gc_stats.pause_tot_ns / gc_stats.slices : 0, gc_stats.pause_max_ns);
+}
+
+thread_local std::vector<entry_key_t> key_in_bnode(CACHE_KEY_NUM);
+inline void get_range_key_from_lnode(bnode *bn, entry_key_t min_key, bool &if_find_a_small_key, int &off, std::vector<value_type_sob> &buf)
+{
+    if (bn == NULL)
+        return;
+
+    uint8_t version;
+    int i;
+    lnode *ln;
+
+    int old_off = off;
+
+retry:
+    wait_for_lock(bn, 1, version);
+    key_in_bnode.clear();
+    if_find_a_small_key = false;
+    off = old_off;
+
+    // search cache
+    for (i = 0; i < bn->meta.v.counter; i++)
+    {
+        if (bn->cache[i].k >= min_key)
+        {
+            if (bn->cache[i].v != TOMBSTONE)
+                buf[off++] = (uint64_t)(bn->cache[i].v);
+            key_in_bnode.push_back(bn->cache[i].k);
+        }
+        else
+            if_find_a_small_key = true;
+    }
+    // 3. search leaf node
+    ln = (lnode *)bn->meta.v.ptr;
+    for (i = 0; i < LEAF_KEY_NUM; i++)
+    {
+        if (ln->meta.bitmap & (1ULL << i))
+        {
+            if (ln->ent[i].k >= min_key)
+            {
+                if (ln->ent[i].v != TOMBSTONE && std::find(key_in_bnode.begin(), key_in_bnode.end(), ln->ent[i].k) == key_in_bnode.end())
                     buf[off++] = (uint64_t)(ln->ent[i].v);
             }
             else
@@ -1635,6 +2859,7 @@ retry:
 // Range operation with linear search
 int btree::btree_search_range(entry_key_t min_key, uint64_t len, std::vector<value_type_sob> &buf)
 {
+    epoch_guard guard;
     page *p = (page *)root;
 
     while (p->hdr.level != 0)
@@ -1644,6 +2869,7 @@ int btree::btree_search_range(entry_key_t min_key, uint64_t len, std::vector<val
 
     int i, off = 0;
     uint8_t previous_switch_counter;
+    uint64_t page_version;
     page *current = p;
     bool if_find_a_small_key;
 
@@ -1652,57 +2878,40 @@ int btree::btree_search_range(entry_key_t min_key, uint64_t len, std::vector<val
         int old_off = off;
         do
         {
+            page_version = current->read_version();
             previous_switch_counter = current->hdr.switch_counter;
             off = old_off;
 
             entry_key_t tmp_key;
             char *tmp_ptr;
 
-            if (IS_FORWARD(previous_switch_counter))
+            // The page version is validated, so the records are read left to right
+            // whatever the shift direction of the last writer was.
+            if ((tmp_key = current->records[0].key) > min_key) // Starting from the far left
             {
-                if ((tmp_key = current->records[0].key) > min_key) // Starting from the far left
-                {
-                    get_range_key_from_lnode((bnode *)current->hdr.leftmost_ptr, min_key, if_find_a_small_key, off, buf);
-                    if (off >= len)
-                    {
-                        goto end;
-                    }
-                }
-
-                for (i = 0; current->records[i].ptr != NULL; ++i)
+                get_range_key_from_lnode((bnode *)current->hdr.leftmost_ptr, min_key, if_find_a_small_key, off, buf);
+                if (off >= len)
                 {
-                    if (current->records[i + 1].key < min_key)
-                        continue;
-                    else
-                    {
-                        get_range_key_from_lnode((bnode *)current->records[i].ptr, min_key, if_find_a_small_key, off, buf);
-                        if (off >= len)
-                        {
-                            goto end;
-                        }
-                    }
+                    goto end;
                 }
             }
-            else
+
+            for (i = 0; current->records[i].ptr != NULL; ++i)
             {
-                for (i = current->count() - 1; i > 0; --i)
+                if (current->records[i + 1].key < min_key)
+                    continue;
+                else
                 {
                     get_range_key_from_lnode((bnode *)current->records[i].ptr, min_key, if_find_a_small_key, off, buf);
-                    if (if_find_a_small_key)
+                    if (off >= len)
                     {
                         goto end;
                     }
                 }
-
-                get_range_key_from_lnode((bnode *)current->hdr.leftmost_ptr, min_key, if_find_a_small_key, off, buf);
-                if (if_find_a_small_key)
-                {
-                    goto end;
-                }
             }
 
-        end:; // end to scan this inode.
-        } while (previous_switch_counter != current->hdr.switch_counter);
+        end:; // end to scan this inode, again if a bnode has been merged away meanwhile
+        } while (previous_switch_counter != current->hdr.switch_counter || !current->validate_version(page_version));
 
         current = (page *)current->hdr.sibling_ptr;
     }
@@ -1710,6 +2919,186 @@ int btree::btree_search_range(entry_key_t min_key, uint64_t len, std::vector<val
     return off;
 }
 
+// Sorted iterator over the kvs below end_key. seek() starts at the smallest key >= key
+// and next() goes up, seek_for_prev() starts at the largest key <= key and prev() goes
+// down (not with STRING_KEY, a key has no predecessor to look up). It reads one bnode at a time and merges the kvs cached in the bnode with the
+// kvs of its leaf node into a scratch buffer that is reused for every bnode.
+class btree_iterator
+{
+public:
+    btree_iterator(btree *t, entry_key_t end_key = LONG_MAX) : t(t), end_key(end_key), upper(LONG_MAX), lower(0), inode(NULL), pos(0), num(0) {}
+
+    void seek(entry_key_t key)
+    {
+        inode = NULL;
+        load(key);
+    }
+#ifndef STRING_KEY
+    void seek_for_prev(entry_key_t key)
+    {
+        inode = NULL;
+        load_prev(std::min(key, end_key - 1));
+    }
+    void prev()
+    {
+        if (--pos < 0 && lower > 0) // keys are > 0
+            load_prev(lower - 1);
+    }
+#endif
+    bool valid() { return pos >= 0 && pos < num; }
+    void next()
+    {
+        if (++pos == num && upper < end_key)
+            load(upper);
+    }
+    entry_key_t key() { return buf[pos].k; }
+    char *value() { return buf[pos].v; }
+
+private:
+    btree *t;
+    entry_key_t end_key;
+    entry_key_t upper; // the first key routed to the bnodes after the loaded one, LONG_MAX if none
+    entry_key_t lower; // the first key routed to the loaded bnode
+    page *inode;       // the last-level page of the loaded bnode, where the next read starts
+    int pos, num;
+    leaf_entry cache[CACHE_KEY_NUM];
+    leaf_entry ent[LEAF_KEY_NUM];
+    leaf_entry buf[CACHE_KEY_NUM + LEAF_KEY_NUM];
+
+    void read(entry_key_t key);
+    void load(entry_key_t key);
+#ifndef STRING_KEY
+    void load_prev(entry_key_t key);
+#endif
+};
+
+static void sort_entries(leaf_entry *e, int n)
+{
+    for (int i = 1; i < n; i++)
+    {
+        leaf_entry x = e[i];
+        int j = i - 1;
+        for (; j >= 0 && e[j].k > x.k; j--)
+            e[j + 1] = e[j];
+        e[j + 1] = x;
+    }
+}
+
+// Read the kvs below end_key of the bnode of key into buf in key order.
+void btree_iterator::read(entry_key_t key)
+{
+    bnode *bn;
+    lnode *ln;
+    leaf_entry e;
+    int i, j, nc, ne;
+    uint64_t bitmap;
+    uint8_t version;
+
+    epoch_guard guard;
+    while (true)
+    {
+        bn = t->get_the_target_bnode(key, 1, NULL, &inode, &upper, inode, &lower);
+        version = bn->meta.v.version;
+        if (IS_LOCKED(version))
+            continue;
+        nc = bn->meta.v.counter;
+        for (i = 0; i < nc; i++)
+            cache[i] = bn->cache[i];
+        ln = (lnode *)bn->meta.v.ptr;
+        bitmap = ln->meta.bitmap;
+        ne = 0;
+        for (i = 0; i < LEAF_KEY_NUM; i++)
+            if (bitmap & (1ULL << i))
+                ent[ne++] = ln->ent[i];
+        if (version == bn->meta.v.version)
+            break;
+    }
+
+    // a cached kv replaces the kv of its key in the leaf node, TOMBSTONE is a delete
+    sort_entries(cache, nc);
+    sort_entries(ent, ne);
+    num = 0;
+    for (i = 0, j = 0; i < nc || j < ne;)
+    {
+        if (j == ne || (i < nc && cache[i].k <= ent[j].k))
+        {
+            if (j < ne && cache[i].k == ent[j].k)
+                j++;
+            e = cache[i++];
+        }
+        else
+            e = ent[j++];
+        if (e.v != TOMBSTONE && e.k < end_key)
+            buf[num++] = e;
+    }
+}
+
+// Go to the smallest key >= key, reading the bnodes from the one of key up.
+void btree_iterator::load(entry_key_t key)
+{
+    while (true)
+    {
+        read(key);
+        for (pos = 0; pos < num && buf[pos].k < key; pos++)
+            ;
+        if (pos < num || upper >= end_key)
+            return;
+        key = upper;
+    }
+}
+
+#ifndef STRING_KEY
+// Go to the largest key <= key, reading the bnodes from the one of key down.
+void btree_iterator::load_prev(entry_key_t key)
+{
+    while (true)
+    {
+        read(key);
+        for (pos = num - 1; pos >= 0 && buf[pos].k > key; pos--)
+            ;
+        if (pos >= 0 || lower <= 0)
+            return;
+        key = lower - 1;
+    }
+}
+#endif
+
+#ifdef __cpp_impl_coroutine
+// Prefetch the path of key, then push the values of the len kvs from key into buf,
+// yielding after every LEAF_KEY_NUM of them. The inner pages are never freed, and the
+// iterator copies the kvs of a bnode under its own guard, so the epoch is only held
+// while a bnode is: a long scan does not hold back the reclamation of the others.
+coro_task btree::scan_coro(entry_key_t key, uint64_t len, std::vector<value_type_sob> *buf)
+{
+    page *p, *inode;
+    bnode *bn;
+
+    p = (page *)root;
+    while (p->hdr.level != 0)
+    {
+        p = (page *)p->linear_search(key);
+        pref_page(p);
+        co_await coro_yield{};
+    }
+    {
+        epoch_guard guard;
+        bn = get_the_target_bnode(key, 1, NULL, &inode, NULL, p);
+        pref(*bn);
+        co_await coro_yield{};
+        pref_lnode((lnode *)bn->meta.v.ptr);
+    }
+    co_await coro_yield{};
+
+    btree_iterator it(this);
+    for (it.seek(key); it.valid() && buf->size() < len; it.next())
+    {
+        buf->push_back((value_type_sob)it.value());
+        if (buf->size() % LEAF_KEY_NUM == 0)
+            co_await coro_yield{};
+    }
+}
+#endif
+
 void btree::printAll()
 {
     int total_keys = 0;
@@ -1743,7 +3132,7 @@ void btree::printinfo_leaf()
 
     while (curr)
     {
-        uint16_t bitmap = curr->meta.bitmap;
+        uint64_t bitmap = curr->meta.bitmap;
         for (int i = 0; i < LEAF_KEY_NUM; i++)
         {
             if (bitmap & 1ULL << i)
@@ -1769,7 +3158,7 @@ void btree::clean_bottom()
         }
     }
 #else
-    for (int i = 0; i <= num_threads; i++)
+    for (int i = 0; i < num_log_groups; i++)
     {
         switch_alt_and_init(i);
     }
@@ -1810,7 +3199,7 @@ void btree::clean_bottom()
     }
 #else
 
-    for (int i = 0; i <= num_threads; i++)
+    for (int i = 0; i < num_log_groups; i++)
     {
         collect_old_log_to_freelist(i);
     }
@@ -1819,3 +3208,338 @@ void btree::clean_bottom()
 
     signal_do_recycle = false;
 }
+
+static entry_key_t min_key_of_lnode(lnode *ln)
+{
+    entry_key_t min_key = LONG_MAX;
+    for (int i = 0; i < LEAF_KEY_NUM; i++)
+    {
+        if ((ln->meta.bitmap & (1ULL << i)) && ln->k(i) < min_key)
+            min_key = ln->k(i);
+    }
+    return min_key;
+}
+
+// Build the inner pages bottom-up over the bnodes ptrs[], where keys[i] is the
+// smallest key routed to ptrs[i] (keys[0] is ignored).
+void btree::build_inner_layer(std::vector<entry_key_t> &keys, std::vector<char *> &ptrs)
+{
+    const uint64_t fanout = cardinality - 1; // leave one free slot in every page
+    uint32_t level = 0;
+
+    while (true)
+    {
+        uint64_t n = ptrs.size();
+        uint64_t num_pages = (n + fanout - 1) / fanout;
+        std::vector<entry_key_t> up_keys(num_pages);
+        std::vector<char *> up_ptrs(num_pages);
+
+        run_in_parallel(num_pages, [&](uint64_t tid, uint64_t from, uint64_t to)
+                        {
+            for (uint64_t p = from; p < to; p++)
+            {
+                page *pg = new page(level);
+                uint64_t begin = p * fanout;
+                uint64_t end = std::min(n, begin + fanout);
+
+                pg->hdr.leftmost_ptr = (uint64_t)ptrs[begin];
+                pg->hdr.minkey = (p == 0) ? 0 : keys[begin];
+
+                int cnt = 0;
+                for (uint64_t i = begin + 1; i < end; i++, cnt++)
+                {
+                    pg->records[cnt].key = keys[i];
+                    pg->records[cnt].ptr = ptrs[i];
+                }
+                pg->records[cnt].ptr = NULL;
+                pg->hdr.last_index = cnt - 1;
+
+                up_keys[p] = pg->hdr.minkey;
+                up_ptrs[p] = (char *)pg;
+            } });
+
+        for (uint64_t p = 0; p + 1 < num_pages; p++)
+            ((page *)up_ptrs[p])->hdr.sibling_ptr = (uint64_t)up_ptrs[p + 1];
+
+        if (level == 0)
+            first_inode = (page *)up_ptrs[0];
+
+        if (num_pages == 1)
+        {
+            root = up_ptrs[0];
+            height = level;
+            return;
+        }
+
+        keys.swap(up_keys);
+        ptrs.swap(up_ptrs);
+        level++;
+    }
+}
+
+#ifndef NUMA_TEST // no recovery with the NUMA logs, see recover()
+// Re-apply the logged kvs, collected by log_collect_for_replay(), that had not been
+// flushed to leaf nodes before the crash.
+uint64_t btree::replay_logs(std::vector<log_entry_t> &entries)
+{
+    // 1. keep the newest entry of every key, the keys are partitioned among the threads.
+    // A kv logged before the last flush of its leaf node has been written to the leaf
+    // node (or overwritten).  Decide it against the leaf nodes as they were at the
+    // crash, before any entry is re-applied. A key not in the leaf nodes may be routed
+    // to another leaf node than before the crash, but every delete is logged, so its
+    // newest entry is replayed unless it is a delete.
+    std::vector<std::vector<log_entry_t>> to_replay(num_threads);
+    run_in_parallel(num_threads, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t part = from; part < to; part++)
+        {
+            std::unordered_map<entry_key_t, log_entry_t> newest;
+            for (auto &e : entries)
+            {
+                entry_key_t key = (long)e.key;
+                if (std::hash<entry_key_t>()(key) % num_threads != part)
+                    continue;
+                auto it = newest.find(key);
+                if (it == newest.end())
+                    newest[key] = e;
+                else if (e.timestamp > it->second.timestamp)
+                    it->second = e;
+            }
+
+            page *inode;
+            for (auto &kv : newest)
+            {
+                entry_key_t key = kv.first;
+                bnode *bn = get_the_target_bnode(key, 1, NULL, &inode);
+                lnode *ln = (lnode *)bn->meta.v.ptr;
+
+                if (search_from_lnode(hashcode1B(key), ln, key) == -1)
+                {
+                    if ((char *)kv.second.value != TOMBSTONE)
+                        to_replay[part].push_back(kv.second);
+                }
+                else if (kv.second.timestamp > ln->meta.timestamp)
+                    to_replay[part].push_back(kv.second);
+            }
+        } });
+
+    // 2. re-apply them in parallel
+    run_in_parallel(num_threads, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t part = from; part < to; part++)
+        {
+            for (auto &e : to_replay[part])
+            {
+                insert((long)e.key, (char *)e.value, true); // logged again in the new log
+            }
+        } });
+
+    uint64_t cnt = 0;
+    for (auto &v : to_replay)
+        cnt += v.size();
+
+    log_release_replayed();
+    return cnt;
+}
+#endif
+
+// Rebuild the DRAM layer (inner pages and bnodes) from the persistent leaf nodes.
+void btree::recover()
+{
+#ifdef NUMA_TEST
+    fprintf(stderr, "recovery is not supported with NUMA_TEST\n");
+    exit(1);
+#else
+    uint64_t time_start = NowNanos();
+
+    treeRoot *r = (treeRoot *)the_thread_nvmpools.get_root();
+    first_lnode = (lnode *)the_thread_nvmpools.relocate(r->first_lnode);
+    if (first_lnode == NULL)
+    {
+        fprintf(stderr, "recovery error: no tree in the NVM pool\n");
+        exit(1);
+    }
+    if ((uint64_t)first_lnode != r->first_lnode)
+    {
+        r->first_lnode = (uint64_t)first_lnode;
+        clflush(r, sizeof(treeRoot));
+    }
+
+    // 1. walk the leaf list, rebase the next pointers and unlink empty leaf nodes.
+    std::vector<lnode *> leaves;
+    lnode *prev = NULL;
+    lnode *ln = first_lnode;
+    while (ln)
+    {
+        lnode *next = (lnode *)the_thread_nvmpools.relocate(ln->meta.next);
+        if ((uint64_t)next != ln->meta.next)
+        {
+            ln->meta.next = (uint64_t)next;
+            clflush(ln, 8);
+        }
+
+        if constexpr (!leaf_geometry::shared_word)
+        {
+            // a split or merge cut short between the stores of next and the bitmap leaves
+            // copies of kvs of the next leaf node in ln, see lnode::setMeta()
+            if (next)
+            {
+                entry_key_t bound = min_key_of_lnode(next);
+                uint64_t bitmap = ln->meta.bitmap;
+                for (int i = 0; i < LEAF_KEY_NUM; i++)
+                    if ((bitmap & (1ULL << i)) && ln->k(i) >= bound)
+                        bitmap &= ~(1ULL << i);
+                if (bitmap != ln->meta.bitmap)
+                {
+                    ln->meta.bitmap = bitmap;
+                    clflush(ln, CACHE_LINE_SIZE);
+                }
+            }
+        }
+
+        if (prev && ln->meta.bitmap == 0)
+        {
+            // its key range is merged into the previous leaf node
+            prev->meta.next = (uint64_t)next;
+            clflush(prev, 8);
+        }
+        else
+        {
+            int pool = the_thread_nvmpools.mark_used(ln, sizeof(lnode));
+            assert(pool >= 0);
+            count_lnode_group[pool]++;
+#ifdef STRING_KEY
+            for (int i = 0; i < LEAF_KEY_NUM; i++)
+                if ((ln->meta.bitmap & (1ULL << i)) && ln->k(i).has_body())
+                    the_thread_nvmpools.mark_used(ln->k(i).body(), sizeof(lnode));
+#endif
+#ifdef VALUE_HEAP
+            for (int i = 0; i < LEAF_KEY_NUM; i++)
+                if ((ln->meta.bitmap & (1ULL << i)) && ln->ch(i) != TOMBSTONE)
+                    vheap_mark_used(ln->ch(i), sizeof(lnode));
+#endif
+
+            leaves.push_back(ln);
+            prev = ln;
+        }
+        ln = next;
+    }
+    the_thread_nvmpools.commit_relocation();
+
+    std::vector<log_entry_t> entries;
+    log_collect_for_replay(entries);
+#ifdef STRING_KEY
+    for (auto &e : entries)
+    {
+        entry_key_t key = (long)e.key;
+        if (key.has_body())
+            the_thread_nvmpools.mark_used(key.body(), sizeof(lnode));
+    }
+#endif
+#ifdef VALUE_HEAP
+    // the handles of older entries too, a blob they hold is only leaked until the next recovery
+    for (auto &e : entries)
+        if ((char *)e.value != TOMBSTONE)
+            vheap_mark_used((char *)e.value, sizeof(lnode));
+#endif
+    // the leaf nodes that are not linked any more are reused, with the chunks of key bodies
+    // and the lines of the value heap
+    long long free_leaves = the_thread_nvmpools.recover_free_nodes(sizeof(lnode));
+
+    uint64_t time_walk = ElapsedNanos(time_start);
+
+    // 2. one bnode per leaf node
+    uint64_t n = leaves.size();
+    std::vector<entry_key_t> keys(n);
+    std::vector<char *> ptrs(n);
+    run_in_parallel(n, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t i = from; i < to; i++)
+        {
+            bnode *bn = alloc_bnode();
+            bn->meta.v.ptr = (uint64_t)leaves[i];
+            ptrs[i] = (char *)bn;
+            keys[i] = (i == 0) ? 0 : min_key_of_lnode(leaves[i]);
+        } });
+
+    // 3. inner pages
+    build_inner_layer(keys, ptrs);
+
+    uint64_t time_build = ElapsedNanos(time_start);
+
+    // 4. logs
+    uint64_t replayed = replay_logs(entries);
+
+    printf("recovery: %lu leaf nodes (%lld free), %lu kvs replayed from logs. walk %lu ns, build %lu ns, total %lu ns\n",
+           n, free_leaves, replayed, time_walk, time_build - time_walk, ElapsedNanos(time_start));
+#endif
+}
+
+// Load n sorted, distinct kvs with keys > 0 into an empty tree, bfill * LEAF_KEY_NUM kvs
+// per leaf node. Every thread fills a range of leaf nodes allocated one after another
+// from its own pool, and writes each of them back in one piece.
+void btree::bulkload(entry_key_t *keys, char **vals, uint64_t n, float bfill)
+{
+    page *old_root = (page *)root;
+    assert(height == 0 && old_root->records[0].ptr == NULL && first_lnode->meta.next == 0);
+    if (n == 0)
+        return;
+    assert(keys[0] > 0);
+
+    uint64_t per_leaf = std::max(1, std::min(LEAF_KEY_NUM, (int)(LEAF_KEY_NUM * bfill)));
+    uint64_t num_leaves = (n + per_leaf - 1) / per_leaf;
+    std::vector<lnode *> leaves(num_leaves);
+
+    // 1. allocate the leaf nodes first, their next pointers are written with them
+    run_in_parallel(num_leaves, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t l = from; l < to; l++)
+            leaves[l] = alloc_lnode(); });
+
+    // 2. fill and persist them
+    uint64_t timestamp = log_now();
+    run_in_parallel(num_leaves, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t l = from; l < to; l++)
+        {
+            lnode *ln = leaves[l];
+            uint64_t begin = l * per_leaf;
+            uint64_t end = std::min(n, begin + per_leaf);
+            for (uint64_t i = begin; i < end; i++)
+            {
+#ifdef STRING_KEY
+                ln->k(i - begin) = persist_key(keys[i]);
+#else
+                ln->k(i - begin) = keys[i];
+#endif
+                ln->ch(i - begin) = vals[i];
+                ln->meta.fgpt[i - begin] = hashcode1B(keys[i]);
+            }
+            ln->meta.bitmap = (1ULL << (end - begin)) - 1;
+            ln->meta.next = (l + 1 < num_leaves) ? (uint64_t)leaves[l + 1] : 0;
+            ln->meta.timestamp = timestamp;
+            clflush(ln, sizeof(lnode));
+        } });
+
+    // 3. link them after the first leaf node, which keeps the minimum kv (0, TOMBSTONE)
+    first_lnode->meta.next = (uint64_t)leaves[0];
+    clflush(first_lnode, 8);
+
+    // 4. one bnode per leaf node, then the inner pages
+    std::vector<entry_key_t> bkeys(num_leaves + 1);
+    std::vector<char *> ptrs(num_leaves + 1);
+    bkeys[0] = 0;
+    ptrs[0] = (char *)old_root->hdr.leftmost_ptr;
+    run_in_parallel(num_leaves, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t l = from; l < to; l++)
+        {
+            bnode *bn = alloc_bnode();
+            bn->meta.v.ptr = (uint64_t)leaves[l];
+            bkeys[l + 1] = leaves[l]->k(0);
+            ptrs[l + 1] = (char *)bn;
+        } });
+
+    build_inner_layer(bkeys, ptrs);
+    delete old_root;
+}
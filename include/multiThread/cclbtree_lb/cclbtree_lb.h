@@ -11,12 +11,334 @@
 #define CACHE_KEY_NUM (2)
 #define OPEN_RTM
 
+// A leaf node left with at most LEAF_MERGE_NUM kvs by a flush is merged into its left
+// sibling under the same inode, if the sibling then holds at most LEAF_MERGE_MAX kvs.
+#define LEAF_MERGE_NUM (LEAF_KEY_NUM / 4)
+#define LEAF_MERGE_MAX (LEAF_KEY_NUM * 3 / 4)
+
 #define META(p) ((inodeMeta *)p)
 
 /********************************************************/
 
 volatile bool signal_do_recycle;
 
+/*
+ * RTM regions with bounded retries and a global fallback lock.
+ * A transaction is retried at most RTM_MAX_RETRIES times after a conflict, and not
+ * retried after a capacity abort; the region then runs under rtm_fallback_lock.
+ * Transactions read the fallback lock, so they abort while it is held.
+ * Aborts on a locked inode/bnode wait for the lock bit instead of counting as a retry.
+ * Without RTM support in the CPU every region runs under the fallback lock.
+ */
+#define RTM_MAX_RETRIES 8
+#define ABORT_FALLBACK 8
+#define ABORT_VALIDATE 9
+
+enum rtm_stat_e
+{
+    RTM_COMMIT = 0,
+    RTM_FALLBACK,
+    RTM_ABORT_CONFLICT,
+    RTM_ABORT_CAPACITY,
+    RTM_ABORT_INODE,
+    RTM_ABORT_BNODE,
+    RTM_ABORT_LOCKED, // the fallback lock was held
+    RTM_ABORT_OTHER,
+    RTM_ABORT_VALIDATE, // optimistic locking: a node read in the region has changed
+    RTM_STAT_NUM
+};
+
+static const char *rtm_stat_name[RTM_STAT_NUM] = {"commit", "fallback", "conflict", "capacity", "inode", "bnode", "locked", "other", "validate"};
+
+inline uint64_t rtm_stats[100][RTM_STAT_NUM];
+inline volatile int rtm_fallback_lock;
+inline bool rtm_supported = (__builtin_cpu_init(), __builtin_cpu_supports("rtm"));
+__thread bool rtm_locked;
+
+__attribute__((target("rtm"))) static void rtm_begin()
+{
+    uint64_t *stats = rtm_stats[thread_id];
+    int retries = 0;
+    while (rtm_supported && retries < RTM_MAX_RETRIES)
+    {
+        while (rtm_fallback_lock)
+            _mm_pause();
+
+        unsigned int stat = _xbegin();
+        if (stat == _XBEGIN_STARTED)
+        {
+            if (rtm_fallback_lock)
+                _xabort(ABORT_FALLBACK);
+            return;
+        }
+
+        if (stat & _XABORT_EXPLICIT)
+        {
+            unsigned int code = _XABORT_CODE(stat);
+            stats[code == ABORT_INODE ? RTM_ABORT_INODE : code == ABORT_BNODE ? RTM_ABORT_BNODE : RTM_ABORT_LOCKED]++;
+            _mm_pause();
+            continue;
+        }
+        if (stat & _XABORT_CAPACITY)
+        {
+            stats[RTM_ABORT_CAPACITY]++;
+            break;
+        }
+        stats[(stat & _XABORT_CONFLICT) ? RTM_ABORT_CONFLICT : RTM_ABORT_OTHER]++;
+        retries++;
+    }
+
+    while (!__sync_bool_compare_and_swap(&rtm_fallback_lock, 0, 1))
+        _mm_pause();
+    rtm_locked = true;
+    stats[RTM_FALLBACK]++;
+}
+
+__attribute__((target("rtm"))) static void rtm_end()
+{
+    if (rtm_locked)
+    {
+        rtm_locked = false;
+        __sync_lock_release(&rtm_fallback_lock);
+        return;
+    }
+    _xend();
+    rtm_stats[thread_id][RTM_COMMIT]++;
+}
+
+// Abort the region to retry it, the caller jumps back to rtm_begin() under the fallback lock.
+template <unsigned char code>
+__attribute__((target("rtm"))) static void rtm_abort()
+{
+    if (rtm_locked)
+    {
+        rtm_stats[thread_id][code == ABORT_INODE ? RTM_ABORT_INODE : RTM_ABORT_BNODE]++;
+        rtm_locked = false;
+        __sync_lock_release(&rtm_fallback_lock);
+        _mm_pause();
+        return;
+    }
+    _xabort(code);
+}
+
+/*
+ * Concurrency control of the regions, chosen at runtime (CCLBTREE_CC=rtm|olc, RTM by
+ * default if the CPU supports it):
+ *  - CC_RTM: the RTM regions above.
+ *  - CC_OLC: optimistic lock coupling. The first word of an inode and a bnode holds a
+ *    lock bit and a version that is bumped on unlock. A region records the words it
+ *    reads, checks the parent is unchanged before it goes down to a child, takes the
+ *    lock bits with a CAS on the recorded word, and validates what it read at the end.
+ *    Unlinked nodes are freed when no region can still hold them, see olc_retire().
+ * Outside a transaction (the RTM fallback lock or CC_OLC) the lock bits taken in a
+ * region are released when it aborts.
+ */
+enum
+{
+    CC_RTM = 0,
+    CC_OLC
+};
+
+#define CC_LOCK_BIT (1ULL << 48)
+#define CC_VERSION_ONE (1ULL << 57) // the version is in the top 7 bits
+#define OLC_MAX_READS 64
+#define OLC_MAX_LOCKS 32
+
+typedef struct olc_read_s
+{
+    volatile uint64_t *word;
+    uint64_t val;
+    bool locked; // locked by this region, no need to validate
+} olc_read_t;
+
+static int cc_mode_init()
+{
+    const char *mode = getenv("CCLBTREE_CC");
+    if (mode && strcmp(mode, "olc") == 0)
+        return CC_OLC;
+    if (mode && strcmp(mode, "rtm") == 0)
+        return CC_RTM;
+    return rtm_supported ? CC_RTM : CC_OLC;
+}
+
+inline int cc_mode = cc_mode_init();
+
+__thread olc_read_t olc_reads[OLC_MAX_READS];
+__thread int olc_nreads;
+__thread volatile uint64_t *cc_locks[OLC_MAX_LOCKS];
+__thread int cc_nlocks;
+
+static inline bool cc_in_tx()
+{
+    return cc_mode == CC_RTM && !rtm_locked;
+}
+
+// Release a lock bit and bump the version.
+static inline void node_unlock(void *node)
+{
+    volatile uint64_t *word = (volatile uint64_t *)node;
+    if (*word & CC_LOCK_BIT)
+        __sync_fetch_and_add(word, CC_VERSION_ONE - CC_LOCK_BIT);
+}
+
+static inline void cc_begin()
+{
+    olc_nreads = 0;
+    cc_nlocks = 0;
+    if (cc_mode == CC_RTM)
+        rtm_begin();
+}
+
+// Validate every word read in the region, except the locked ones.
+static inline bool cc_validate()
+{
+    if (cc_mode == CC_RTM)
+        return true;
+    for (int i = 0; i < olc_nreads; i++)
+    {
+        if (!olc_reads[i].locked && *(olc_reads[i].word) != olc_reads[i].val)
+            return false;
+    }
+    return true;
+}
+
+// Read the word of a node in the region. Return false if it is locked, or if its
+// parent (the node read before) has changed, then the region must abort. With CC_OLC
+// the parent is checked first, so the pointer to the node was read consistently.
+static inline bool cc_check(void *node)
+{
+    volatile uint64_t *word = (volatile uint64_t *)node;
+    if (cc_mode == CC_RTM)
+        return !(*word & CC_LOCK_BIT);
+
+    if (olc_nreads > 0)
+    {
+        olc_read_t *parent = &olc_reads[olc_nreads - 1];
+        if (!parent->locked && *(parent->word) != parent->val)
+            return false;
+    }
+    uint64_t val = *word;
+    if (val & CC_LOCK_BIT)
+        return false;
+    if (olc_nreads == OLC_MAX_READS) // a long scan, keep the nodes read so far consistent
+    {
+        if (!cc_validate())
+            return false;
+        olc_nreads = 0;
+    }
+    olc_reads[olc_nreads++] = {word, val, false};
+    return true;
+}
+
+// Take the lock bit of a node in the region. Return false if it cannot, then the
+// region must abort.
+static inline bool cc_lock(void *node)
+{
+    volatile uint64_t *word = (volatile uint64_t *)node;
+    if (cc_in_tx())
+    {
+        *word |= CC_LOCK_BIT;
+        return true;
+    }
+
+    olc_read_t *r = NULL;
+    for (int i = olc_nreads - 1; i >= 0; i--)
+    {
+        if (olc_reads[i].word == word)
+        {
+            r = &olc_reads[i];
+            break;
+        }
+    }
+    uint64_t val = r ? r->val : *word;
+    if ((val & CC_LOCK_BIT) || cc_nlocks == OLC_MAX_LOCKS || !__sync_bool_compare_and_swap(word, val, val | CC_LOCK_BIT))
+        return false;
+    cc_locks[cc_nlocks++] = word;
+    for (int i = 0; i < olc_nreads; i++)
+    {
+        if (olc_reads[i].word == word)
+            olc_reads[i].locked = true;
+    }
+    return true;
+}
+
+static inline void cc_end()
+{
+    if (cc_mode == CC_RTM)
+        rtm_end();
+    else
+        rtm_stats[thread_id][RTM_COMMIT]++;
+    olc_nreads = 0;
+    cc_nlocks = 0;
+}
+
+// Abort the region, the caller jumps back to cc_begin().
+template <unsigned char code>
+static inline void cc_abort()
+{
+    if (!cc_in_tx())
+    {
+        for (int i = cc_nlocks - 1; i >= 0; i--)
+            node_unlock((void *)cc_locks[i]);
+        cc_nlocks = 0;
+    }
+    if (cc_mode == CC_RTM)
+    {
+        rtm_abort<code>();
+        return;
+    }
+    rtm_stats[thread_id][code == ABORT_INODE ? RTM_ABORT_INODE : code == ABORT_BNODE ? RTM_ABORT_BNODE : RTM_ABORT_VALIDATE]++;
+    _mm_pause();
+}
+
+// Wait for the lock bit of a node outside a region.
+static inline void node_lock(void *node)
+{
+    volatile uint64_t *word = (volatile uint64_t *)node;
+    while (true)
+    {
+        uint64_t val = *word;
+        if (!(val & CC_LOCK_BIT) && __sync_bool_compare_and_swap(word, val, val | CC_LOCK_BIT))
+            return;
+        _mm_pause();
+    }
+}
+
+// With CC_OLC a thread publishes its epoch in an operation, see tools/epoch.h.
+struct olc_guard
+{
+    olc_guard()
+    {
+        if (cc_mode == CC_OLC)
+            epoch_enter(thread_id);
+    }
+    ~olc_guard()
+    {
+        if (cc_mode == CC_OLC)
+            epoch_exit(thread_id);
+    }
+};
+
+static void print_rtm_stats()
+{
+    uint64_t tot[RTM_STAT_NUM] = {0};
+    printf("concurrency control: %s\n", cc_mode == CC_RTM ? (rtm_supported ? "rtm" : "rtm (fallback lock only)") : "olc");
+    for (int i = 0; i <= num_threads; i++)
+    {
+        printf("rtm thread %d:", i);
+        for (int j = 0; j < RTM_STAT_NUM; j++)
+        {
+            printf(" %s %lu", rtm_stat_name[j], rtm_stats[i][j]);
+            tot[j] += rtm_stats[i][j];
+        }
+        printf("\n");
+    }
+    printf("rtm total:");
+    for (int j = 0; j < RTM_STAT_NUM; j++)
+        printf(" %s %lu", rtm_stat_name[j], tot[j]);
+    printf("\n");
+}
+
 class lnode;
 class Pointer8B;
 
@@ -55,10 +377,11 @@ typedef struct inode_entry
  *   ch(0), ch(1) .. ch(NON_LEAF_KEY_NUM)
  */
 typedef struct inodeMeta
-{                       /* 8B */
-    uint64_t next : 48; /* pointer to the next inode*/
-    uint64_t lock : 1;  /* lock bit for concurrency control */
-    uint64_t num : 15;  /* number of keys */
+{                         /* 8B */
+    uint64_t next : 48;   /* pointer to the next inode*/
+    uint64_t lock : 1;    /* lock bit for concurrency control */
+    uint64_t num : 8;     /* number of keys */
+    uint64_t version : 7; /* bumped on unlock, see node_unlock() */
 } inodeMeta;
 
 class inode
@@ -79,10 +402,11 @@ typedef struct bnode
 {
     uint64_t ptr : 48; // pointer to leaf node
     uint64_t lock : 1;
-    uint64_t epoch_num : 10; // for GC
-    uint64_t counter : 5;
-    leaf_entry cache[CACHE_KEY_NUM]; // the number of KVs that are not flushed to leaf nodes
-} bnode;                             // bnode
+    uint64_t epoch_num : 5; // for GC
+    uint64_t counter : 3;   // the number of KVs that are not flushed to leaf nodes
+    uint64_t version : 7;   // bumped on unlock, see node_unlock()
+    leaf_entry cache[CACHE_KEY_NUM];
+} bnode; // bnode
 
 /**
  * leafnode: leaf node
@@ -119,6 +443,42 @@ public:
     }
 }; // leafnode
 
+/**
+ * treeRoot: persistent entry of the tree, kept in the root area of the NVM pool header.
+ *
+ */
+typedef struct treeRoot
+{
+    uint64_t first_lnode;
+} treeRoot;
+
+static void free_inode(void *p)
+{
+    delete (inode *)p;
+}
+
+static void free_lnode(void *p)
+{
+    nvmpool_free_node(p);
+}
+
+// Free an inode, a bnode or a leaf node unlinked from the tree. Without CC_OLC no
+// reader can hold it out of a region, and a transaction touching it aborts.
+static void olc_retire(void *p, epoch_free_fn fn)
+{
+    if (cc_mode != CC_OLC)
+        fn(p);
+    else
+        epoch_retire(p, fn);
+}
+
+// With CC_OLC the root may have split between reading tree_root and root_level.
+#define root_unchanged(in, level) (cc_mode != CC_OLC || ((in) == *(inode *volatile *)&tree_root && (level) == *(volatile int *)&root_level))
+
+// The merge operator of upsert_with(): the new value of a key from its old value, 0 if
+// absent, and the operand. A new value 0 deletes the key.
+typedef value_type_sob (*merge_fn)(value_type_sob old, value_type_sob operand);
+
 class tree
 {
 public:
@@ -129,7 +489,12 @@ public:
     inode *first_inode;
     lnode *first_lnode;
 
-    void insert_lnode(key_type_sob key, value_type_sob val, bool update);
+    void insert_lnode(key_type_sob key, value_type_sob val, bool update, merge_fn merge = NULL, value_type_sob operand = 0);
+    void upsert_with(key_type_sob key, merge_fn fn, value_type_sob operand);
+    void insert_batch(key_type_sob *keys, value_type_sob *vals, int n);
+    bnode *descend_bnode(key_type_sob key, key_type_sob &upper, bool &has_upper);
+    bnode *lock_bnode(key_type_sob key, key_type_sob &upper, bool &has_upper);
+    int insert_run(leaf_entry *run, int n);
     value_type_sob search_lnode(key_type_sob key);
     int scan(key_type_sob minkey, uint64_t len, std::vector<value_type_sob> &buf);
 
@@ -152,6 +517,12 @@ public:
     void recycle_bottom_naive();
 
     void recycle_bottom_naive_2();
+
+    void recover();
+    void bulkload(key_type_sob *keys, value_type_sob *vals, uint64_t n, float bfill);
+    void build_inner_layer(std::vector<key_type_sob> &keys, std::vector<uint64_t> &ptrs);
+    bnode *find_bnode(key_type_sob key);
+    uint64_t replay_logs();
 };
 /* ---------------------------------------------------------------------- */
 
@@ -179,40 +550,81 @@ bnode *tree::alloc_bnode()
 lnode *tree::alloc_lnode()
 {
     count_lnode_group[thread_id]++;
-    return (lnode *)nvmpool_alloc(sizeof(lnode));
+    return (lnode *)nvmpool_alloc_node(sizeof(lnode));
 }
 
 void tree::dealloc_lnode(lnode *ln)
 {
     count_lnode_group[thread_id]--;
 
-    nvmpool_free(ln);
+    olc_retire(ln, free_lnode);
 }
 
 std::future<void> bg_thread;
 volatile bool signal_run_bgthread;
+
+// split [0, n) into num_threads ranges and run fn(tid, from, to) on each of them.
+template <typename F>
+static void run_in_parallel(uint64_t n, F fn)
+{
+    std::vector<std::future<void>> futures;
+    uint64_t per_thread = (n + num_threads - 1) / num_threads;
+    for (uint64_t tid = 0; tid < num_threads; tid++)
+    {
+        uint64_t from = per_thread * tid;
+        uint64_t to = std::min(n, from + per_thread);
+        if (from >= to)
+            break;
+        futures.push_back(std::async(
+            std::launch::async, [&fn](uint64_t from, uint64_t to, uint64_t tid)
+            {
+                worker_id = tid;
+                thread_id = tid;
+                fn(tid, from, to); },
+            from, to, tid));
+    }
+    for (auto &&f : futures)
+        f.get();
+}
+
 tree::tree(bool is_recovery = false)
 {
-    first_inode = alloc_inode();
-    META(first_inode)->next = NULL;
-    META(first_inode)->num = 0;
-    META(first_inode)->lock = 0;
+    epoch_num = 0;
+    lnode_size = sizeof(lnode);
+
+    signal_do_recycle = false;
 
-    bnode *first_bnode = alloc_bnode();
-    first_lnode = alloc_lnode();
+    if (is_recovery)
+    {
+        recover();
+    }
+    else
+    {
+        first_inode = alloc_inode();
+        META(first_inode)->next = NULL;
+        META(first_inode)->num = 0;
+        META(first_inode)->lock = 0;
 
-    tree_root = first_inode;
-    first_bnode->ptr = (uint64_t)first_lnode;
-    first_inode->ch(0) = (uint64_t)first_bnode;
+        bnode *first_bnode = alloc_bnode();
+        first_lnode = alloc_lnode();
 
-    first_lnode->meta.bitmap = 1; // Insert (0,0) as a minimum kv to prevent the deletion of the first leaf node.
+        tree_root = first_inode;
+        first_bnode->ptr = (uint64_t)first_lnode;
+        first_inode->ch(0) = (uint64_t)first_bnode;
 
-    root_level = 0;
-    epoch_num = 0;
+        first_lnode->meta.bitmap = 1; // Insert (0,0) as a minimum kv to prevent the deletion of the first leaf node.
+        clflush(first_lnode, sizeof(lnode));
 
-    signal_do_recycle = false;
+        root_level = 0;
+
+#ifndef NUMA_TEST
+        treeRoot *r = (treeRoot *)the_thread_nvmpools.get_root();
+        r->first_lnode = (uint64_t)first_lnode;
+        clflush(r, sizeof(treeRoot));
+#endif
+    }
 
-    signal_run_bgthread = !is_recovery;
+    signal_run_bgthread = true;
     _mm_mfence();
     bg_thread = std::async(
         std::launch::async, [&]()
@@ -225,6 +637,7 @@ tree::tree(bool is_recovery = false)
 
             // printf("signal_run_bgthread = %d, begin!\n", signal_run_bgthread);
             thread_id = num_threads;
+            uint64_t gc_check = NowNanos();
             while (signal_run_bgthread)
             {
                 // printf("%d\n",signal_do_recycle);
@@ -232,6 +645,20 @@ tree::tree(bool is_recovery = false)
                 {
                     recycle_bottom();
                 }
+#ifndef NUMA_TEST
+                if (log_commit_window)
+                {
+                    log_commit_expired();
+                }
+#endif
+                // sleep until a writer asks for GC or the next timer expires
+                bg_wait(bg_timeout_ns());
+                if (BG_GC_INTERVAL_MS && ElapsedNanos(gc_check) >= BG_GC_INTERVAL_MS * 1000000ULL)
+                {
+                    gc_check = NowNanos();
+                    if (signal_do_recycle == false && if_log_recycle())
+                        signal_do_recycle = true;
+                }
             } });
 }
 
@@ -257,7 +684,7 @@ static void insert_into_logs(uint64_t key, uint64_t ptr, bool gc)
 #endif
 
         count_add_log++;
-        if ((count_add_log % 10000 == 0) && signal_do_recycle == false)
+        if ((count_add_log % LOG_RECYCLE_CHECK_INTERVAL == 0) && signal_do_recycle == false)
         {
             if (if_log_recycle())
             {
@@ -265,6 +692,7 @@ static void insert_into_logs(uint64_t key, uint64_t ptr, bool gc)
                 if (__sync_bool_compare_and_swap(&signal_do_recycle, false, true))
                 {
                     // printf("signal_do_recycle = %d\n", signal_do_recycle);
+                    bg_wake();
                 }
                 // signal_do_recycle = true;
             }
@@ -367,35 +795,40 @@ value_type_sob tree::search_lnode(key_type_sob key)
     bnode *bn;
     lnode *ln;
 
-    int i, t, m, b;
+    int i, t, m, b, level;
     key_type_sob r;
+    value_type_sob ret;
 
     unsigned char key_hash = hashcode1B(key);
+    olc_guard guard;
 Again3:
 #ifdef OPEN_RTM
     // 1. RTM begin
-    if (_xbegin() != _XBEGIN_STARTED)
-        goto Again3;
+    cc_begin();
 #endif
 
     sfence();
     // _mm_sfence();
     // 2. search nonleaf nodes
-    in = tree_root;
-    for (i = root_level; i >= 0; i--) // search from root to bottom.
+    level = *(volatile int *)&root_level;
+    in = *(inode *volatile *)&tree_root;
+    for (i = level; i >= 0; i--) // search from root to bottom.
     {
         // if the lock bit is set, abort
-        if (META(in)->lock)
-        {
 #ifdef OPEN_RTM
-            _xabort(ABORT_INODE);
-#endif
+        if (!cc_check(in) || (i == level && !root_unchanged(in, level)))
+        {
+            cc_abort<ABORT_INODE>();
             goto Again3;
         }
+#else
+        if (META(in)->lock)
+            goto Again3;
+#endif
 
         // binary search to narrow down to at most 8 entries
         b = 1;
-        t = META(in)->num;
+        t = std::min((int)META(in)->num, NON_LEAF_KEY_NUM);
         while (b + 7 <= t)
         {
             m = (b + t) >> 1;
@@ -422,13 +855,16 @@ Again3:
     bn = (bnode *)in;
 
     // if the lock bit is set, abort
-    if (bn->lock)
-    {
 #ifdef OPEN_RTM
-        _xabort(ABORT_BNODE);
-#endif
+    if (!cc_check(bn))
+    {
+        cc_abort<ABORT_BNODE>();
         goto Again3;
     }
+#else
+    if (bn->lock)
+        goto Again3;
+#endif
 
     // 2.5 search cache
     {
@@ -436,27 +872,48 @@ Again3:
         for (b = 0; b < CACHE_KEY_NUM; b++)
             if (key == bn->cache[b].k)
             {
-#ifdef OPEN_RTM
-                _xend();
-#endif
-                return bn->cache[b].v;
+                ret = bn->cache[b].v;
+                goto found;
             }
     }
 
-    // 3. search leaf node
-    ln = (lnode *)bn->ptr;
+    {
+        // 3. search leaf node
+        ln = (lnode *)bn->ptr;
 
-    int ret_pos = search_from_lnode(key_hash, ln, key);
+        int ret_pos = search_from_lnode(key_hash, ln, key);
+        ret = ret_pos == -1 ? 0 : ln->ch(ret_pos);
+    }
 
+found:
 #ifdef OPEN_RTM
+    if (!cc_validate())
+    {
+        cc_abort<ABORT_VALIDATE>();
+        goto Again3;
+    }
     // 4. RTM commit
-    _xend();
+    cc_end();
 #endif
 
-    return ret_pos == -1 ? 0 : ln->ch(ret_pos);
+    return ret;
+}
+
+// Undo the writes of insert_lnode() to a full bnode before it retries, which a
+// transaction would roll back but a region out of a transaction does not. The lock
+// bit is released by cc_abort().
+static void undo_bnode_flush(bnode *bn)
+{
+    bn->counter = CACHE_KEY_NUM;
+#ifdef NUMA_TEST
+    (the_logpool.vlog_groups->flushed_count[the_logpool.vlog_groups->alt]) -= CACHE_KEY_NUM;
+#else
+    (vlog_groups[thread_id]->flushed_count[vlog_groups[thread_id]->alt]) -= CACHE_KEY_NUM;
+#endif
 }
 
-void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
+// With merge, val is merge(the value of key, operand), computed under the bnode lock.
+void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update, merge_fn merge, value_type_sob operand)
 {
 
     // record the path from root to leaf
@@ -478,49 +935,48 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
     unsigned char key_hash_group[CACHE_KEY_NUM + 1];
     int8_t slot_id[CACHE_KEY_NUM + 1];
     int increment = 0;
+    int remaining = 0; // kvs left in ln after the flush
 
     /* Part 1. get the positions to insert the key */
 
+    olc_guard guard;
     {
 
-        int i, t, m, b;
+        int i, t, m, b, level;
         key_type_sob r;
 
     Again3:
 #ifdef OPEN_RTM
         // 1. RTM begin
-        int stat = _xbegin();
-        if (stat != _XBEGIN_STARTED)
-        {
-            // if (_XABORT_CODE(stat) == ABORT_BNODE)
-            // count_conflict_in_bnode[thread_id]++;
-            goto Again3;
-        }
-
+        cc_begin();
 #endif
         sfence();
         // _mm_sfence();
         // 2. search nonleaf nodes
-        in = tree_root;
+        level = *(volatile int *)&root_level;
+        in = *(inode *volatile *)&tree_root;
 
-        for (i = root_level; i >= 0; i--) // search from root to bottom.
+        for (i = level; i >= 0; i--) // search from root to bottom.
         {
 
             // if the lock bit is set, abort
-            if (META(in)->lock)
-            {
 #ifdef OPEN_RTM
-                _xabort(ABORT_INODE);
-#endif
+            if (!cc_check(in) || (i == level && !root_unchanged(in, level)))
+            {
+                cc_abort<ABORT_INODE>();
                 goto Again3;
             }
+#else
+            if (META(in)->lock)
+                goto Again3;
+#endif
 
             parray[i] = in;
             isfull[i] = (META(in)->num == NON_LEAF_KEY_NUM);
 
             // binary search to narrow down to at most 8 entries
             b = 1;
-            t = META(in)->num;
+            t = std::min((int)META(in)->num, NON_LEAF_KEY_NUM);
             while (b + 7 <= t)
             {
                 m = (b + t) >> 1;
@@ -550,13 +1006,16 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
 
         // 2.5 search bottom leaf
         //  if the lock bit is set, abort
-        if (bn->lock)
-        {
 #ifdef OPEN_RTM
-            _xabort(ABORT_BNODE);
-#endif
+        if (!cc_check(bn))
+        {
+            cc_abort<ABORT_BNODE>();
             goto Again3;
         }
+#else
+        if (bn->lock)
+            goto Again3;
+#endif
 
         // 2.5 search the buffer node
 
@@ -573,7 +1032,12 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                 else // find the key, just return
                 {
 #ifdef OPEN_RTM
-                    _xend();
+                    if (!cc_validate())
+                    {
+                        cc_abort<ABORT_VALIDATE>();
+                        goto Again3;
+                    }
+                    cc_end();
 #endif
                     return;
                 }
@@ -582,11 +1046,29 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
 
         if (cpos < CACHE_KEY_NUM) // update the buffer node without accessing the leaf node.
         {
-            bn->lock = 1;
 #ifdef OPEN_RTM
-            _xend();
+            if (!cc_lock(bn))
+            {
+                cc_abort<ABORT_BNODE>();
+                goto Again3;
+            }
+            cc_end();
+#else
+            bn->lock = 1;
 #endif
 
+            if (merge)
+            {
+                if (cpos < bn->counter)
+                    val = merge(bn->cache[cpos].v, operand);
+                else
+                {
+                    ln = (lnode *)bn->ptr;
+                    int pos = search_from_lnode(hashcode1B(key), ln, key);
+                    val = merge(pos == -1 ? 0 : ln->ch(pos), operand);
+                }
+            }
+
             bn->cache[cpos].k = key;
             bn->cache[cpos].v = val;
             if (cpos == bn->counter) // insert this kv in a new empty slot
@@ -599,12 +1081,23 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                 bn->epoch_num &= (~(1ULL << cpos));
 
             insert_into_logs(key, val, false);
-            bn->lock = 0;
+            node_unlock(bn);
 
             return;
         }
         else // the buffer node is full, insert this kv into the leaf node.
         {
+            // 3. set the lock bit of the bnode before writing it
+#ifdef OPEN_RTM
+            if (!cc_lock(bn))
+            {
+                cc_abort<ABORT_BNODE>();
+                goto Again3;
+            }
+#else
+            bn->lock = 1;
+#endif
+
             // 3. search leaf node
             ln = (lnode *)bn->ptr;
 #ifdef NUMA_TEST
@@ -623,11 +1116,14 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                 if ((update == false) && (slot_id[0] != -1)) // find the target kv in the leaf node, just return.
                 {
 #ifdef OPEN_RTM
-                    _xend();
+                    cc_end();
+                    node_unlock(bn);
                     return;
 #endif
                 }
 
+                if (merge)
+                    val = merge(slot_id[0] == -1 ? 0 : ln->ch(slot_id[0]), operand);
                 key_group[0].k = key;
                 key_group[0].v = val;
                 key_hash_group[0] = key_hash;
@@ -649,6 +1145,7 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                 //   |   delete  |   -1      |   0
                 //   |   insert  |   0       |   +1
 
+                increment = 0; // not rolled back when a region out of a transaction retries
                 for (i = 0; i < CACHE_KEY_NUM + 1; i++)
                 {
                     if (key_group[i].v == 0 && slot_id[i] != -1)
@@ -656,30 +1153,41 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                     else if (key_group[i].v != 0 && slot_id[i] == -1)
                         increment++;
                 }
+                remaining = ln->num() + increment;
             }
 
             // 4. set lock bits before exiting the RTM transaction
-            bn->lock = 1;
-
             if (ln->isAlmostFull(increment)) // split
             {
 
-                for (i = 0; i <= root_level; i++)
+                for (i = 0; i <= level; i++)
                 {
                     in = (inode *)parray[i];
+#ifdef OPEN_RTM
+                    if (!cc_lock(in))
+                    {
+                        if (!cc_in_tx())
+                            undo_bnode_flush(bn);
+                        cc_abort<ABORT_INODE>();
+                        goto Again3;
+                    }
+#else
                     META(in)->lock = 1;
+#endif
                     if (!isfull[i])
                         break;
                 }
             }
-            else if (ln->num() + increment <= 0) // delete
+            else if (remaining <= 0 || (remaining <= LEAF_MERGE_NUM && ppos[0] >= 1)) // delete or merge
             {
+                // A merged leaf keeps its key range in the same inode. ch(0) is not merged,
+                // its range would be routed to ch(1) after it is removed.
                 // look for its bnode sibling and inode sibling
 
                 inode *p = NULL;
 
                 // from bottom to top
-                for (i = 0; i <= root_level; i++)
+                for (i = 0; i <= level; i++)
                 {
                     if (ppos[i] >= 1) // first leaf node will not be del, so i can not > root_level afte exitting the loop.
                         break;
@@ -690,30 +1198,82 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                 p = (inode *)p->ch(ppos[i] - 1);
                 i--;
 
+#ifdef OPEN_RTM
+                // the sibling is read from parray[i], not from the node read last
+                if (!cc_validate())
+                {
+                    if (!cc_in_tx())
+                        undo_bnode_flush(bn);
+                    cc_abort<ABORT_VALIDATE>();
+                    goto Again3;
+                }
+#endif
                 for (; i >= 0; i--)
                 {
-                    if (META(p)->lock)
-                    {
 #ifdef OPEN_RTM
-                        _xabort(ABORT_INODE);
-#endif
+                    if (!cc_check(p))
+                    {
+                        if (!cc_in_tx())
+                            undo_bnode_flush(bn);
+                        cc_abort<ABORT_INODE>();
                         goto Again3;
                     }
+#else
+                    if (META(p)->lock)
+                        goto Again3;
+#endif
 
                     if (i == 0) // find the inode sibp
                         inode_sibp = p;
-                    p = (inode *)p->ch(META(p)->num);
+                    p = (inode *)p->ch(std::min((int)META(p)->num, NON_LEAF_KEY_NUM));
                 }
 
                 bnode_sibp = (bnode *)p;
 
-                if (bnode_sibp->lock)
+                if (remaining > 0)
                 {
 #ifdef OPEN_RTM
-                    _xabort(ABORT_BNODE);
+                    if (!cc_check(bnode_sibp))
+                    {
+                        if (!cc_in_tx())
+                            undo_bnode_flush(bn);
+                        cc_abort<ABORT_BNODE>();
+                        goto Again3;
+                    }
 #endif
+                    if (((lnode *)bnode_sibp->ptr)->num() + remaining > LEAF_MERGE_MAX)
+                        goto no_merge;
+                }
+
+#ifdef OPEN_RTM
+                // lock bnode_sibp, the inode in level 0, and if the inode will be deleted,
+                // the inode sibp and the affected ancestors(inode)
+                bool locked = cc_check(bnode_sibp) && cc_lock(bnode_sibp) && cc_lock(parray[0]);
+                if (locked && META(parray[0])->num < 1)
+                {
+                    locked = cc_lock(inode_sibp);
+                    for (i = 1; locked && i <= level; i++)
+                    {
+                        p = (inode *)parray[i];
+                        locked = cc_lock(p);
+
+                        if (META(p)->num >= 1)
+                            break; // at least 2 children, ok to stop
+                    }
+                }
+                if (!locked || !cc_validate())
+                {
+                    if (!cc_in_tx())
+                        undo_bnode_flush(bn);
+                    cc_abort<ABORT_BNODE>();
                     goto Again3;
                 }
+
+                // 4. RTM commit
+                cc_end();
+#else
+                if (bnode_sibp->lock)
+                    goto Again3;
                 // lock bnode_sibp
                 bnode_sibp->lock = 1;
 
@@ -726,7 +1286,7 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                     META(inode_sibp)->lock = 1;
 
                     // lock affected ancestors(inode)
-                    for (i = 1; i <= root_level; i++)
+                    for (i = 1; i <= level; i++)
                     {
                         p = (inode *)parray[i];
                         META(p)->lock = 1;
@@ -735,22 +1295,30 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                             break; // at least 2 children, ok to stop
                     }
                 }
-
-#ifdef OPEN_RTM
-                // 4. RTM commit
-                _xend();
 #endif
                 goto delete_the_leaf_node;
             }
+        no_merge:;
 #ifdef OPEN_RTM
+            if (!cc_validate())
+            {
+                if (!cc_in_tx())
+                    undo_bnode_flush(bn);
+                cc_abort<ABORT_VALIDATE>();
+                goto Again3;
+            }
             // 4. RTM commit
-            _xend();
+            cc_end();
 #endif
         }
     }
 
 #ifdef TREE_NO_SELECLOG
     insert_into_logs(key, val, false);
+#else
+    // deletes are logged for recovery, see replay_logs()
+    if (val == 0)
+        insert_into_logs(key, val, false);
 #endif
 
     lnodeMeta meta;
@@ -814,13 +1382,13 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
 
         sfence();
 
-        meta.timestamp = _rdtsc();
+        meta.timestamp = log_now();
 
         ln->setMeta(&meta);
         clflush(ln, CACHE_LINE_SIZE);
 
         // unlock
-        bn->lock = 0;
+        node_unlock(bn);
 
         return;
     }
@@ -837,7 +1405,7 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
     split_leaf_node:
 
         // 2.1 get sorted positions
-        int timestamp = _rdtsc();
+        uint64_t timestamp = log_now();
         int sorted_pos[LEAF_KEY_NUM];
         for (int i = 0; i < LEAF_KEY_NUM; i++)
             sorted_pos[i] = i;
@@ -958,7 +1526,7 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                 newbn->cache[i] = new_cache[i];
             }
             sfence();
-            bn->lock = 0;
+            node_unlock(bn);
         }
     }
 
@@ -994,7 +1562,7 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                 sfence();
 
                 // unlock after all changes are globally visible
-                META(p)->lock = 0;
+                node_unlock(p);
 
                 return;
             }
@@ -1045,9 +1613,9 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
 
             sfence();
 
-            META(newin)->lock = 0;
+            node_unlock(newin);
             if (lev < total_level)
-                META(p)->lock = 0; // do not clear lock bit of root
+                node_unlock(p); // do not clear lock bit of root
 
             lev++;
         } /* end of while loop */
@@ -1069,10 +1637,10 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                   // old root and new root are both locked
 
         // unlock old root
-        META(old_root)->lock = 0;
+        node_unlock(old_root);
 
         // unlock new root
-        META(newin)->lock = 0;
+        node_unlock(newin);
 
         return;
 
@@ -1084,20 +1652,85 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
     delete_the_leaf_node:
 #ifdef TREE_NO_SELECLOG
         insert_into_logs(key, val, false);
+#else
+        if (val == 0)
+            insert_into_logs(key, val, false);
 #endif
 
         // printf("del\n");
         assert(bnode_sibp);
         lnode *lnode_sibp = (lnode *)bnode_sibp->ptr;
+        lnodeMeta meta = lnode_sibp->meta;
+
+        if (remaining > 0) // merge the kvs of ln into free slots of the sibling
+        {
+            bool need_to_flush[4] = {false, false, false, false};
+            uint16_t bitmap = ln->meta.bitmap;
+            int index, slot;
+
+            for (index = 0; index < CACHE_KEY_NUM + 1; index++)
+            {
+                if (slot_id[index] != -1)
+                {
+                    if (key_group[index].v == 0) // delete
+                        bitmap &= (~(1 << slot_id[index]));
+                    else // update
+                        ln->ent[slot_id[index]].v = key_group[index].v;
+                }
+            }
+
+            for (index = 0; index < LEAF_KEY_NUM; index++)
+            {
+                if (bitmap & (1 << index))
+                {
+                    slot = bitScan(~meta.bitmap) - 1;
+                    lnode_sibp->ent[slot] = ln->ent[index];
+                    insert_into_logs(ln->ent[index].k, ln->ent[index].v, false);
+                    meta.fgpt[slot] = ln->meta.fgpt[index];
+                    meta.bitmap |= (1 << slot);
+                    need_to_flush[(slot + 2) / 4] = true;
+                }
+            }
+
+            for (index = 0; index < CACHE_KEY_NUM + 1; index++)
+            {
+                if (slot_id[index] == -1 && key_group[index].v != 0)
+                {
+                    slot = bitScan(~meta.bitmap) - 1;
+                    lnode_sibp->ent[slot] = key_group[index];
+                    insert_into_logs(key_group[index].k, key_group[index].v, false);
+                    meta.fgpt[slot] = key_hash_group[index];
+                    meta.bitmap |= (1 << slot);
+                    need_to_flush[(slot + 2) / 4] = true;
+                }
+            }
+
+            for (int cacheline_number = 3; cacheline_number >= 1; cacheline_number--)
+            {
+                if (need_to_flush[cacheline_number])
+                    clflush_nofence((char *)lnode_sibp + cacheline_number * 64, CACHE_LINE_SIZE);
+            }
+
+            // The timestamp of the sibling still covers its own kvs, the moved kvs are
+            // logged again above and their newest entries win in recovery. They are
+            // durable before the kvs are published. The fingerprints of free slots are
+            // not read.
+#ifndef NUMA_TEST
+            log_commit();
+#endif
+            memcpy(lnode_sibp->meta.fgpt, meta.fgpt, sizeof(meta.fgpt));
+            sfence();
+        }
 
-        // remove it from sibling linked list
-        lnode_sibp->meta.next = ln->meta.next;
+        // remove it from sibling linked list, the bitmap and the pointer share one word
+        meta.next = ln->meta.next;
+        *(volatile uint64_t *)lnode_sibp = *(uint64_t *)&meta;
 
-        clflush(lnode_sibp, 8); // flush the pointer
-        bnode_sibp->lock = 0;   // lock bit is not protected.
+        clflush(lnode_sibp, remaining > 0 ? CACHE_LINE_SIZE : 8); // flush the pointer
+        node_unlock(bnode_sibp); // lock bit is not protected.
 
         dealloc_lnode(ln);
-        free(bn);
+        olc_retire(bn, free);
 
         /* Part 3: non-leaf node */
         {
@@ -1125,7 +1758,7 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                     META(p)->num = n - 1;
                     sfence();
                     // all changes are globally visible now
-                    META(p)->lock = 0;
+                    node_unlock(p);
                     return;
                 }
 
@@ -1136,18 +1769,294 @@ void tree::insert_lnode(key_type_sob key, value_type_sob val, bool update)
                     // update the inode list in level 0.
                     META(inode_sibp)->next = META(p)->next;
                     sfence();
-                    META(inode_sibp)->lock = 0;
+                    node_unlock(inode_sibp);
                 }
 
-                delete p;
+                olc_retire(p, free_inode);
                 lev++;
             } /* end of while */
         }
     }
 }
 
+// search_from_lnode() against a meta region that is not written back yet
+static int search_in_meta(lnode *ln, lnodeMeta *meta, key_type_sob key)
+{
+    unsigned char key_hash = hashcode1B(key);
+    for (int i = 0; i < LEAF_KEY_NUM; i++)
+    {
+        if ((meta->bitmap & (1 << i)) && meta->fgpt[i] == key_hash && ln->k(i) == key)
+            return i;
+    }
+    return -1;
+}
+
+// Apply kv (0 deletes it) to ln under the meta region meta. Return false if there is
+// no free slot for it.
+static bool write_into_lnode(lnode *ln, lnodeMeta *meta, leaf_entry kv, bool need_to_flush[4])
+{
+    int slot = search_in_meta(ln, meta, kv.k);
+    if (kv.v == 0)
+    {
+        if (slot != -1)
+            meta->bitmap &= (~(1 << slot));
+        return true;
+    }
+    if (slot == -1)
+    {
+        if (meta->bitmap == 0x3fff)
+            return false;
+        slot = bitScan(~meta->bitmap) - 1;
+        ln->k(slot) = kv.k;
+        meta->fgpt[slot] = hashcode1B(kv.k);
+        meta->bitmap |= (1 << slot);
+    }
+    ln->ch(slot) = kv.v;
+    need_to_flush[(slot + 2) / 4] = true;
+    return true;
+}
+
+// Set the value of key to fn(its value, operand) in one locked section of its bnode. A
+// cached key is updated in the bnode only. fn may be called more than once, if the
+// section is retried.
+void tree::upsert_with(key_type_sob key, merge_fn fn, value_type_sob operand)
+{
+    insert_lnode(key, 0, true, fn, operand);
+}
+
+// Descend to the bnode of key in a region, NULL if the region has aborted. upper is
+// the smallest key routed to the bnodes after it, if has_upper is set.
+bnode *tree::descend_bnode(key_type_sob key, key_type_sob &upper, bool &has_upper)
+{
+    inode *in;
+    int i, b, t, level;
+
+    has_upper = false;
+    level = *(volatile int *)&root_level;
+    in = *(inode *volatile *)&tree_root;
+
+    for (i = level; i >= 0; i--)
+    {
+#ifdef OPEN_RTM
+        if (!cc_check(in) || (i == level && !root_unchanged(in, level)))
+        {
+            cc_abort<ABORT_INODE>();
+            return NULL;
+        }
+#else
+        if (META(in)->lock)
+            return NULL;
+#endif
+        t = std::min((int)META(in)->num, NON_LEAF_KEY_NUM);
+        for (b = 1; b <= t; b++)
+            if (key < in->k(b))
+                break;
+        if (b <= t)
+        {
+            upper = in->k(b);
+            has_upper = true;
+        }
+        in = (inode *)in->ch(b - 1);
+    }
+    return (bnode *)in;
+}
+
+// Lock the bnode of key, see descend_bnode() for upper. The key range of a bnode does
+// not change while it is locked.
+bnode *tree::lock_bnode(key_type_sob key, key_type_sob &upper, bool &has_upper)
+{
+    bnode *bn;
+
+Again:
+#ifdef OPEN_RTM
+    cc_begin();
+#endif
+    sfence();
+    bn = descend_bnode(key, upper, has_upper);
+    if (bn == NULL)
+        goto Again;
+#ifdef OPEN_RTM
+    if (!cc_check(bn) || !cc_lock(bn))
+    {
+        cc_abort<ABORT_BNODE>();
+        goto Again;
+    }
+    cc_end();
+#else
+    if (bn->lock)
+        goto Again;
+    bn->lock = 1;
+#endif
+    return bn;
+}
+
+// Write the sorted kvs run[0..n) that are routed to one bnode in one locked section.
+// Return the number of kvs written, 0 if the leaf node has to split first.
+int tree::insert_run(leaf_entry *run, int n)
+{
+    olc_guard guard;
+
+    key_type_sob upper;
+    bool has_upper;
+    bnode *bn = lock_bnode(run[0].k, upper, has_upper);
+
+    // the kvs of the same bnode, up to the first deletion
+    int m = 1;
+    while (m < n && run[m].v != 0 && (!has_upper || run[m].k < upper))
+        m++;
+
+    int i, b, index, slot;
+    int cpos[CACHE_KEY_NUM];
+    int counter = bn->counter;
+
+    // 1. they fit into the free cache slots, buffer and log them as insert_lnode() does
+    if (m <= CACHE_KEY_NUM)
+    {
+        for (i = 0; i < m; i++)
+        {
+            for (b = 0; b < bn->counter; b++)
+                if (bn->cache[b].k == run[i].k)
+                    break;
+            cpos[i] = (b < bn->counter) ? b : counter++;
+        }
+
+        if (counter <= CACHE_KEY_NUM)
+        {
+            for (i = 0; i < m; i++)
+            {
+                bn->cache[cpos[i]] = run[i];
+                if (epoch_num)
+                    bn->epoch_num |= (1ULL << cpos[i]);
+                else
+                    bn->epoch_num &= (~(1ULL << cpos[i]));
+                insert_into_logs(run[i].k, run[i].v, false);
+            }
+            bn->counter = counter;
+            node_unlock(bn);
+            return m;
+        }
+    }
+
+    // 2. flush the cached kvs and the run into the leaf node
+    lnode *ln = (lnode *)bn->ptr;
+    lnodeMeta meta = ln->meta;
+
+    bool need_to_flush[4];
+    need_to_flush[0] = true;
+    need_to_flush[1] = false;
+    need_to_flush[2] = false;
+    need_to_flush[3] = false;
+
+    // the cached kvs and at least the first kv of the run must fit, so the leaf node is
+    // not left empty
+    uint16_t bitmap = meta.bitmap;
+    int new_slots = 0;
+    bool first_cached = false;
+    for (b = 0; b < bn->counter; b++)
+    {
+        slot = search_from_lnode(hashcode1B(bn->cache[b].k), ln, bn->cache[b].k);
+        if (slot != -1 && bn->cache[b].v == 0) // delete
+            bitmap &= (~(1 << slot));
+        else if (slot == -1 && bn->cache[b].v != 0)
+            new_slots++;
+        if (bn->cache[b].k == run[0].k)
+        {
+            first_cached = true;
+            if (bn->cache[b].v == 0)
+                new_slots++;
+        }
+    }
+    if (!first_cached && search_from_lnode(hashcode1B(run[0].k), ln, run[0].k) == -1)
+        new_slots++;
+
+    if (countBit(bitmap) + new_slots > LEAF_KEY_NUM)
+    {
+        node_unlock(bn);
+        return 0;
+    }
+
+#ifdef NUMA_TEST
+    (the_logpool.vlog_groups->flushed_count[the_logpool.vlog_groups->alt]) += bn->counter;
+#else
+    (vlog_groups[thread_id]->flushed_count[vlog_groups[thread_id]->alt]) += bn->counter;
+#endif
+
+    for (b = 0; b < bn->counter; b++)
+        write_into_lnode(ln, &meta, bn->cache[b], need_to_flush);
+
+    for (index = 0; index < m; index++)
+    {
+        if (!write_into_lnode(ln, &meta, run[index], need_to_flush))
+            break;
+#ifdef TREE_NO_SELECLOG
+        insert_into_logs(run[index].k, run[index].v, false);
+#endif
+    }
+
+    // a single flush of the leaf node
+    for (int cacheline_number = 3; cacheline_number >= 1; cacheline_number--)
+    {
+        if (need_to_flush[cacheline_number])
+            clflush_nofence((char *)ln + cacheline_number * 64, CACHE_LINE_SIZE);
+    }
+    sfence();
+
+    meta.timestamp = log_now();
+    ln->setMeta(&meta);
+    clflush(ln, CACHE_LINE_SIZE);
+
+    // the cached kvs are kept for search, keep them up to date
+    for (b = 0; b < CACHE_KEY_NUM; b++)
+    {
+        slot = search_in_meta(ln, &meta, bn->cache[b].k);
+        bn->cache[b].v = (slot == -1) ? 0 : ln->ch(slot);
+    }
+
+    bn->counter = 0;
+    node_unlock(bn);
+    return index;
+}
+
+// Insert or overwrite n kvs, a value of 0 deletes the key as in insert_lnode(). The batch
+// is sorted and every run of kvs routed to one bnode is written in one locked section,
+// with at most one flush of its leaf node. Splits and deletions go through insert_lnode().
+void tree::insert_batch(key_type_sob *keys, value_type_sob *vals, int n)
+{
+    std::vector<leaf_entry> batch(n);
+    for (int i = 0; i < n; i++)
+    {
+        batch[i].k = keys[i];
+        batch[i].v = vals[i];
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const leaf_entry &x, const leaf_entry &y)
+                     { return x.k < y.k; });
+
+    // the last kv of a key wins
+    int m = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (m > 0 && batch[m - 1].k == batch[i].k)
+            batch[m - 1] = batch[i];
+        else
+            batch[m++] = batch[i];
+    }
+
+    for (int i = 0; i < m;)
+    {
+        int done = (batch[i].v == 0) ? 0 : insert_run(&batch[i], m - i);
+        if (done == 0) // fill the buffer until the leaf node splits, then batch again
+        {
+            for (; done < CACHE_KEY_NUM + 1 && i + done < m; done++)
+                insert_lnode(batch[i + done].k, batch[i + done].v, true);
+        }
+        i += done;
+    }
+}
+
 void tree::recycle_bottom()
 {
+    uint64_t gc_start = NowNanos();
+
 // initialize new log files
 #ifdef NUMA_TEST
     for (int i = 0; i < NUM_NUMA_NODE; i++)
@@ -1158,7 +2067,7 @@ void tree::recycle_bottom()
         }
     }
 #else
-    for (int i = 0; i <= num_threads; i++)
+    for (int i = 0; i < num_log_groups; i++)
     {
         switch_alt_and_init(i);
     }
@@ -1173,43 +2082,17 @@ void tree::recycle_bottom()
     bnode *bn;
 
     /* lock the first_inode; */
-    {
-    Again1:
-#ifdef OPEN_RTM
-        // 1. RTM begin
-        if (_xbegin() != _XBEGIN_STARTED)
-        {
-            goto Again1;
-        }
-#endif
-        sfence();
-        if (META(in)->lock)
-        {
-#ifdef OPEN_RTM
-            _xabort(ABORT_INODE);
-#endif
-            goto Again1;
-        }
-
-        META(in)->lock = 1;
-#ifdef OPEN_RTM
-        _xend();
-#endif
-    }
+    // The locks are taken outside a region: a writer holding a bnode or an inode
+    // never waits for the lock of another node, it aborts its region instead.
+    node_lock(in);
     while (true)
     {
         /* in has been locked*/
         for (int i_bnode = 0; i_bnode <= META(in)->num; i_bnode++)
         {
             bn = (bnode *)in->ch(i_bnode);
-            volatile bnode *bn_vo = bn;
-            while ((bn_vo->lock)) // bn has been locked, waitting.
-            {
-                ;
-            }
-            sfence();
+            node_lock(bn); // bn has been locked, waitting.
             assert(META(in)->lock);
-            assert(bn_vo->lock != 1);
 
             for (int i_cache = 0; i_cache < bn->counter; i_cache++)
             {
@@ -1222,42 +2105,18 @@ void tree::recycle_bottom()
                         bn->epoch_num &= (~(1 << i_cache));
                 }
             }
-            assert(bn_vo->lock != 1);
+            node_unlock(bn);
         }
         /* lock the next inode; */
+        // the next pointer of a locked inode does not change
+        next_in = (inode *)META(in)->next;
+        if (!next_in)
         {
-        Again2:
-#ifdef OPEN_RTM
-            // 1. RTM begin
-            if (_xbegin() != _XBEGIN_STARTED)
-            {
-                goto Again2;
-            }
-#endif
-            sfence();
-            next_in = (inode *)META(in)->next;
-            if (!next_in)
-            {
-#ifdef OPEN_RTM
-                _xend();
-#endif
-                META(in)->lock = 0;
-                goto done;
-            }
-            if (META(next_in)->lock)
-            {
-#ifdef OPEN_RTM
-                _xabort(ABORT_INODE);
-#endif
-                goto Again2;
-            }
-
-            META(next_in)->lock = 1;
-#ifdef OPEN_RTM
-            _xend();
-#endif
+            node_unlock(in);
+            goto done;
         }
-        META(in)->lock = 0;
+        node_lock(next_in);
+        node_unlock(in);
         in = next_in;
     } // loop of bnode
 
@@ -1270,13 +2129,14 @@ done:
     }
 #else
 
-    for (int i = 0; i <= num_threads; i++)
+    for (int i = 0; i < num_log_groups; i++)
     {
         collect_old_log_to_freelist(i);
     }
 
 #endif // NUMA_TEST
 
+    log_recycled(ElapsedNanos(gc_start));
     signal_do_recycle = false;
 }
 
@@ -1294,7 +2154,7 @@ void tree::clean_bottom()
         }
     }
 #else
-    for (int i = 0; i <= num_threads; i++)
+    for (int i = 0; i < num_log_groups; i++)
     {
         switch_alt_and_init(i);
     }
@@ -1320,7 +2180,7 @@ void tree::clean_bottom()
     }
 #else
 
-    for (int i = 0; i <= num_threads; i++)
+    for (int i = 0; i < num_log_groups; i++)
     {
         collect_old_log_to_freelist(i);
     }
@@ -1337,36 +2197,41 @@ int tree::scan(key_type_sob minkey, uint64_t len, std::vector<value_type_sob> &b
     inode *cur_in;
     bnode *bn;
     lnode *ln;
-    int i, t, m, b, i_bnode;
+    int i, t, m, b, i_bnode, level;
     key_type_sob r;
 
+    uint64_t buf_start = buf.size();
+    olc_guard guard;
 Again3:
     is_first_node = true;
+    buf.resize(buf_start); // drop the kvs of an aborted try
 #ifdef OPEN_RTM
-    if (_xbegin() != _XBEGIN_STARTED)
-        goto Again3;
+    cc_begin();
 #endif
     sfence();
 
     // 2. search nonleaf nodes
-    in = tree_root;
+    level = *(volatile int *)&root_level;
+    in = *(inode *volatile *)&tree_root;
 
-    for (i = root_level; i >= 0; i--) // search from root to bottom.
+    for (i = level; i >= 0; i--) // search from root to bottom.
     {
 
         // if the lock bit is set, abort
-        if (META(in)->lock)
-        {
-
 #ifdef OPEN_RTM
-            _xabort(ABORT_INODE);
-#endif
+        if (!cc_check(in) || (i == level && !root_unchanged(in, level)))
+        {
+            cc_abort<ABORT_INODE>();
             goto Again3;
         }
+#else
+        if (META(in)->lock)
+            goto Again3;
+#endif
 
         // binary search to narrow down to at most 8 entries
         b = 1;
-        t = META(in)->num;
+        t = std::min((int)META(in)->num, NON_LEAF_KEY_NUM);
         while (b + 7 <= t)
         {
             m = (b + t) >> 1;
@@ -1397,13 +2262,16 @@ Again3:
     bn = (bnode *)in;
 
     // if the lock bit is set, abort
-    if (bn->lock)
-    {
 #ifdef OPEN_RTM
-        _xabort(ABORT_BNODE);
-#endif
+    if (!cc_check(bn))
+    {
+        cc_abort<ABORT_BNODE>();
         goto Again3;
     }
+#else
+    if (bn->lock)
+        goto Again3;
+#endif
 
     while (buf.size() < len)
     {
@@ -1446,32 +2314,167 @@ Again3:
             if (!cur_in)
             { //  reaches the tail
 #ifdef OPEN_RTM
-                _xend();
+                if (!cc_validate())
+                {
+                    cc_abort<ABORT_VALIDATE>();
+                    goto Again3;
+                }
+                cc_end();
 #endif
                 return buf.size();
             }
-            if (META(cur_in)->lock)
-            {
+            // the parent of cur_in and bn is not the node read last, validate all
 #ifdef OPEN_RTM
-                _xabort(ABORT_INODE);
-#endif
+            if (!cc_validate() || !cc_check(cur_in))
+            {
+                cc_abort<ABORT_INODE>();
                 goto Again3;
             }
+#else
+            if (META(cur_in)->lock)
+                goto Again3;
+#endif
             i_bnode = 0;
         }
 
         bn = (bnode *)cur_in->ch(i_bnode);
+#ifdef OPEN_RTM
+        if (cc_mode == CC_OLC && (!cc_validate() || !cc_check(bn)))
+        {
+            cc_abort<ABORT_BNODE>();
+            goto Again3;
+        }
+#endif
 
         is_first_node = false;
     }
 
 #ifdef OPEN_RTM
+    if (!cc_validate())
+    {
+        cc_abort<ABORT_VALIDATE>();
+        goto Again3;
+    }
     // 4. RTM commit
-    _xend();
+    cc_end();
 #endif
     return buf.size();
 }
 
+// Sorted iterator over the kvs in [key of seek(), end_key). It reads one bnode at a
+// time and merges the kvs cached in the bnode with the kvs of its leaf node into a
+// scratch buffer that is reused for every bnode.
+class tree_iterator
+{
+public:
+    tree_iterator(tree *t, key_type_sob end_key = LONG_MAX) : t(t), end_key(end_key), has_upper(false), pos(0), num(0) {}
+
+    void seek(key_type_sob key) { load(key); }
+    bool valid() { return pos < num; }
+    void next()
+    {
+        if (++pos == num && has_upper && upper < end_key)
+            load(upper);
+    }
+    key_type_sob key() { return buf[pos].k; }
+    value_type_sob value() { return buf[pos].v; }
+
+private:
+    tree *t;
+    key_type_sob end_key;
+    key_type_sob upper; // the first key routed to the bnodes after the loaded one
+    bool has_upper;
+    int pos, num;
+    leaf_entry cache[CACHE_KEY_NUM];
+    leaf_entry ent[LEAF_KEY_NUM];
+    leaf_entry buf[CACHE_KEY_NUM + LEAF_KEY_NUM];
+
+    void load(key_type_sob key);
+};
+
+static void sort_entries(leaf_entry *e, int n)
+{
+    for (int i = 1; i < n; i++)
+    {
+        leaf_entry x = e[i];
+        int j = i - 1;
+        for (; j >= 0 && e[j].k > x.k; j--)
+            e[j + 1] = e[j];
+        e[j + 1] = x;
+    }
+}
+
+// Load the kvs >= key of the first bnode from the one of key that has any.
+void tree_iterator::load(key_type_sob key)
+{
+    bnode *bn;
+    lnode *ln;
+    leaf_entry e;
+    int i, j, nc, ne;
+    uint16_t bitmap;
+
+    olc_guard guard;
+    while (true)
+    {
+    Again:
+#ifdef OPEN_RTM
+        cc_begin();
+#endif
+        sfence();
+        bn = t->descend_bnode(key, upper, has_upper);
+        if (bn == NULL)
+            goto Again;
+#ifdef OPEN_RTM
+        if (!cc_check(bn))
+        {
+            cc_abort<ABORT_BNODE>();
+            goto Again;
+        }
+#else
+        if (bn->lock)
+            goto Again;
+#endif
+        nc = bn->counter;
+        for (i = 0; i < nc; i++)
+            cache[i] = bn->cache[i];
+        ln = (lnode *)bn->ptr;
+        bitmap = ln->meta.bitmap;
+        ne = 0;
+        for (i = 0; i < LEAF_KEY_NUM; i++)
+            if (bitmap & (1 << i))
+                ent[ne++] = ln->ent[i];
+#ifdef OPEN_RTM
+        if (!cc_validate())
+        {
+            cc_abort<ABORT_VALIDATE>();
+            goto Again;
+        }
+        cc_end();
+#endif
+
+        // a cached kv replaces the kv of its key in the leaf node, value 0 is a delete
+        sort_entries(cache, nc);
+        sort_entries(ent, ne);
+        pos = num = 0;
+        for (i = 0, j = 0; i < nc || j < ne;)
+        {
+            if (j == ne || (i < nc && cache[i].k <= ent[j].k))
+            {
+                if (j < ne && cache[i].k == ent[j].k)
+                    j++;
+                e = cache[i++];
+            }
+            else
+                e = ent[j++];
+            if (e.v != 0 && e.k >= key && e.k < end_key)
+                buf[num++] = e;
+        }
+        if (num > 0 || !has_upper || upper >= end_key)
+            return;
+        key = upper;
+    }
+}
+
 void tree::printinfo_leaf()
 {
     lnode *curr = first_lnode;
@@ -1518,4 +2521,304 @@ void tree::printinfo_bnode()
         printf("||");
         curr = (inode *)META(curr)->next;
     }
-}
\ No newline at end of file
+}
+
+static key_type_sob min_key_of_lnode(lnode *ln)
+{
+    key_type_sob min_key = LONG_MAX;
+    for (int i = 0; i < LEAF_KEY_NUM; i++)
+    {
+        if ((ln->meta.bitmap & (1 << i)) && ln->k(i) < min_key)
+            min_key = ln->k(i);
+    }
+    return min_key;
+}
+
+// Build the inodes bottom-up over the bnodes ptrs[], where keys[i] is the
+// smallest key routed to ptrs[i] (keys[0] is ignored).
+void tree::build_inner_layer(std::vector<key_type_sob> &keys, std::vector<uint64_t> &ptrs)
+{
+    const uint64_t fanout = NON_LEAF_KEY_NUM; // leave one free slot in every inode
+    int level = 0;
+
+    while (true)
+    {
+        uint64_t n = ptrs.size();
+        uint64_t num_inodes = (n + fanout - 1) / fanout;
+        std::vector<key_type_sob> up_keys(num_inodes);
+        std::vector<uint64_t> up_ptrs(num_inodes);
+
+        run_in_parallel(num_inodes, [&](uint64_t tid, uint64_t from, uint64_t to)
+                        {
+            for (uint64_t p = from; p < to; p++)
+            {
+                inode *in = alloc_inode();
+                uint64_t begin = p * fanout;
+                uint64_t end = std::min(n, begin + fanout);
+
+                in->ch(0) = ptrs[begin];
+                for (uint64_t i = begin + 1; i < end; i++)
+                {
+                    in->k(i - begin) = keys[i];
+                    in->ch(i - begin) = ptrs[i];
+                }
+                META(in)->next = NULL;
+                META(in)->lock = 0;
+                META(in)->num = end - begin - 1;
+
+                up_keys[p] = keys[begin];
+                up_ptrs[p] = (uint64_t)in;
+            } });
+
+        if (level == 0)
+        {
+            for (uint64_t p = 0; p + 1 < num_inodes; p++)
+                META(up_ptrs[p])->next = up_ptrs[p + 1];
+            first_inode = (inode *)up_ptrs[0];
+        }
+
+        if (num_inodes == 1)
+        {
+            tree_root = (inode *)up_ptrs[0];
+            root_level = level;
+            return;
+        }
+
+        keys.swap(up_keys);
+        ptrs.swap(up_ptrs);
+        level++;
+    }
+}
+
+// find the bnode of key without concurrency control, only for recovery.
+bnode *tree::find_bnode(key_type_sob key)
+{
+    inode *in = tree_root;
+    int b, t;
+
+    for (int i = root_level; i >= 0; i--)
+    {
+        t = META(in)->num;
+        for (b = 1; b <= t; b++)
+            if (key < in->k(b))
+                break;
+        in = (inode *)in->ch(b - 1);
+    }
+    return (bnode *)in;
+}
+
+#ifndef NUMA_TEST // no recovery with the NUMA logs, see recover()
+// Re-apply the logged kvs that had not been flushed to leaf nodes before the crash.
+uint64_t tree::replay_logs()
+{
+    std::vector<log_entry_t> entries;
+    log_collect_for_replay(entries);
+
+    // 1. keep the newest entry of every key, the keys are partitioned among the threads.
+    // A kv logged before the last flush of its leaf node has been written to the leaf
+    // node (or overwritten).  Decide it against the leaf nodes as they were at the
+    // crash, before any entry is re-applied. A key not in the leaf nodes may be routed
+    // to another leaf node than before the crash, but every delete is logged, so its
+    // newest entry is replayed unless it is a delete.
+    std::vector<std::vector<log_entry_t>> to_replay(num_threads);
+    run_in_parallel(num_threads, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t part = from; part < to; part++)
+        {
+            std::unordered_map<uint64_t, log_entry_t> newest;
+            for (auto &e : entries)
+            {
+                if (e.key % num_threads != part)
+                    continue;
+                auto it = newest.find(e.key);
+                if (it == newest.end())
+                    newest[e.key] = e;
+                else if (e.timestamp > it->second.timestamp)
+                    it->second = e;
+            }
+
+            for (auto &kv : newest)
+            {
+                key_type_sob key = kv.first;
+                lnode *ln = (lnode *)find_bnode(key)->ptr;
+
+                if (search_from_lnode(hashcode1B(key), ln, key) == -1)
+                {
+                    if (kv.second.value != 0)
+                        to_replay[part].push_back(kv.second);
+                }
+                else if (kv.second.timestamp > ln->meta.timestamp)
+                    to_replay[part].push_back(kv.second);
+            }
+        } });
+
+    // 2. re-apply them in parallel
+    run_in_parallel(num_threads, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t part = from; part < to; part++)
+        {
+            for (auto &e : to_replay[part])
+            {
+                insert_lnode(e.key, e.value, true); // logged again in the new log
+            }
+        } });
+
+    uint64_t cnt = 0;
+    for (auto &v : to_replay)
+        cnt += v.size();
+
+    log_release_replayed();
+    return cnt;
+}
+#endif
+
+// Rebuild the DRAM layer (inodes and bnodes) from the persistent leaf nodes.
+void tree::recover()
+{
+#ifdef NUMA_TEST
+    fprintf(stderr, "recovery is not supported with NUMA_TEST\n");
+    exit(1);
+#else
+    uint64_t time_start = NowNanos();
+
+    treeRoot *r = (treeRoot *)the_thread_nvmpools.get_root();
+    first_lnode = (lnode *)the_thread_nvmpools.relocate(r->first_lnode);
+    if (first_lnode == NULL)
+    {
+        fprintf(stderr, "recovery error: no tree in the NVM pool\n");
+        exit(1);
+    }
+    if ((uint64_t)first_lnode != r->first_lnode)
+    {
+        r->first_lnode = (uint64_t)first_lnode;
+        clflush(r, sizeof(treeRoot));
+    }
+
+    // 1. walk the leaf list, rebase the next pointers and unlink empty leaf nodes
+    //    (e.g. a deletion interrupted by the crash).
+    std::vector<lnode *> leaves;
+    lnode *prev = NULL;
+    lnode *ln = first_lnode;
+    while (ln)
+    {
+        lnode *next = (lnode *)the_thread_nvmpools.relocate(ln->meta.next);
+        if ((uint64_t)next != ln->meta.next)
+        {
+            ln->meta.next = (uint64_t)next;
+            clflush(ln, 8);
+        }
+
+        if (prev && ln->meta.bitmap == 0)
+        {
+            // its key range is merged into the previous leaf node
+            prev->meta.next = (uint64_t)next;
+            clflush(prev, 8);
+        }
+        else
+        {
+            int pool = the_thread_nvmpools.mark_used(ln, sizeof(lnode));
+            assert(pool >= 0);
+            count_lnode_group[pool]++;
+
+            leaves.push_back(ln);
+            prev = ln;
+        }
+        ln = next;
+    }
+    the_thread_nvmpools.commit_relocation();
+    // the leaf nodes that are not linked any more are reused
+    long long free_leaves = the_thread_nvmpools.recover_free_nodes(sizeof(lnode));
+
+    uint64_t time_walk = ElapsedNanos(time_start);
+
+    // 2. one bnode per leaf node
+    uint64_t n = leaves.size();
+    std::vector<key_type_sob> keys(n);
+    std::vector<uint64_t> ptrs(n);
+    run_in_parallel(n, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t i = from; i < to; i++)
+        {
+            bnode *bn = alloc_bnode();
+            bn->ptr = (uint64_t)leaves[i];
+            ptrs[i] = (uint64_t)bn;
+            keys[i] = (i == 0) ? 0 : min_key_of_lnode(leaves[i]);
+        } });
+
+    // 3. inodes
+    build_inner_layer(keys, ptrs);
+
+    uint64_t time_build = ElapsedNanos(time_start);
+
+    // 4. logs
+    uint64_t replayed = replay_logs();
+
+    printf("recovery: %lu leaf nodes (%lld free), %lu kvs replayed from logs. walk %lu ns, build %lu ns, total %lu ns\n",
+           n, free_leaves, replayed, time_walk, time_build - time_walk, ElapsedNanos(time_start));
+#endif
+}
+
+// Load n sorted, distinct kvs with keys > 0 into an empty tree, bfill * LEAF_KEY_NUM kvs
+// per leaf node. Every thread fills a range of leaf nodes allocated one after another
+// from its own pool, and writes each of them back in one piece.
+void tree::bulkload(key_type_sob *keys, value_type_sob *vals, uint64_t n, float bfill)
+{
+    assert(root_level == 0 && META(tree_root)->num == 0 && first_lnode->meta.next == 0);
+    if (n == 0)
+        return;
+    assert(keys[0] > 0);
+
+    uint64_t per_leaf = std::max(1, std::min(LEAF_KEY_NUM, (int)(LEAF_KEY_NUM * bfill)));
+    uint64_t num_leaves = (n + per_leaf - 1) / per_leaf;
+    std::vector<lnode *> leaves(num_leaves);
+
+    // 1. allocate the leaf nodes first, their next pointers are written with them
+    run_in_parallel(num_leaves, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t l = from; l < to; l++)
+            leaves[l] = alloc_lnode(); });
+
+    // 2. fill and persist them
+    uint64_t timestamp = log_now();
+    run_in_parallel(num_leaves, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t l = from; l < to; l++)
+        {
+            lnode *ln = leaves[l];
+            uint64_t begin = l * per_leaf;
+            uint64_t end = std::min(n, begin + per_leaf);
+            for (uint64_t i = begin; i < end; i++)
+            {
+                ln->k(i - begin) = keys[i];
+                ln->ch(i - begin) = vals[i];
+                ln->meta.fgpt[i - begin] = hashcode1B(keys[i]);
+            }
+            ln->meta.bitmap = (1 << (end - begin)) - 1;
+            ln->meta.next = (l + 1 < num_leaves) ? (uint64_t)leaves[l + 1] : 0;
+            ln->meta.timestamp = timestamp;
+            clflush(ln, sizeof(lnode));
+        } });
+
+    // 3. link them after the first leaf node, which keeps the minimum kv (0, 0)
+    first_lnode->meta.next = (uint64_t)leaves[0];
+    clflush(first_lnode, 8);
+
+    // 4. one bnode per leaf node, then the inodes
+    std::vector<key_type_sob> bkeys(num_leaves + 1);
+    std::vector<uint64_t> ptrs(num_leaves + 1);
+    bkeys[0] = 0;
+    ptrs[0] = tree_root->ch(0);
+    run_in_parallel(num_leaves, [&](uint64_t tid, uint64_t from, uint64_t to)
+                    {
+        for (uint64_t l = from; l < to; l++)
+        {
+            bnode *bn = alloc_bnode();
+            bn->ptr = (uint64_t)leaves[l];
+            bkeys[l + 1] = keys[l * per_leaf];
+            ptrs[l + 1] = (uint64_t)bn;
+        } });
+
+    inode *old_root = tree_root;
+    build_inner_layer(bkeys, ptrs);
+    free_inode(old_root);
+}
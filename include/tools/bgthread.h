@@ -0,0 +1,50 @@
+#pragma once
+
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+
+// The background thread of CCL-BTree sleeps here instead of spinning. It is woken
+// up by bg_wake() when a writer asks for GC or the tree is closed, and by the
+// timeout for the work that runs on a timer.
+
+// check the log space on a timer, 0 only on the writers' request
+#ifndef BG_GC_INTERVAL_MS
+#define BG_GC_INTERVAL_MS 100
+#endif
+
+inline pthread_mutex_t bg_lock = PTHREAD_MUTEX_INITIALIZER;
+inline pthread_cond_t bg_cond = PTHREAD_COND_INITIALIZER;
+inline bool bg_wakeup;
+
+static inline void bg_wake()
+{
+    pthread_mutex_lock(&bg_lock);
+    bg_wakeup = true;
+    pthread_cond_signal(&bg_cond);
+    pthread_mutex_unlock(&bg_lock);
+}
+
+// Sleep until bg_wake() or for timeout_ns, 0 means no timeout.
+static inline void bg_wait(uint64_t timeout_ns)
+{
+    pthread_mutex_lock(&bg_lock);
+    if (!bg_wakeup)
+    {
+        if (timeout_ns == 0)
+        {
+            pthread_cond_wait(&bg_cond, &bg_lock);
+        }
+        else
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t ns = ts.tv_nsec + timeout_ns;
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&bg_cond, &bg_lock, &ts);
+        }
+    }
+    bg_wakeup = false;
+    pthread_mutex_unlock(&bg_lock);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <coroutine>
+#include <deque>
+#include <vector>
+#include <exception>
+
+// Coroutines to interleave tree operations on one thread (C++20). An operation
+// suspends after it prefetches the next node it reads, and the scheduler runs the
+// other operations in flight while the line is loaded.
+
+struct coro_task
+{
+    struct promise_type
+    {
+        coro_task get_return_object() { return coro_task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+// suspend the operation, co_await coro_yield{}
+using coro_yield = std::suspend_always;
+
+// Round-robin scheduler with at most width operations in flight. The operations are
+// run by the thread calling run(), which returns when all of them have completed. The
+// operations in flight may complete in any order.
+class coro_scheduler
+{
+public:
+    coro_scheduler(int width = 8) : width(width) {}
+    ~coro_scheduler()
+    {
+        for (std::coroutine_handle<> h : pending)
+            h.destroy();
+    }
+
+    void spawn(coro_task t) { pending.push_back(t.h); }
+
+    void run()
+    {
+        while (!pending.empty() || !running.empty())
+        {
+            while ((int)running.size() < width && !pending.empty())
+            {
+                running.push_back(pending.front());
+                pending.pop_front();
+            }
+            for (size_t i = 0; i < running.size();)
+            {
+                running[i].resume();
+                if (running[i].done())
+                {
+                    running[i].destroy();
+                    running[i] = running.back();
+                    running.pop_back();
+                }
+                else
+                    i++;
+            }
+        }
+    }
+
+private:
+    int width;
+    std::deque<std::coroutine_handle<>> pending;
+    std::vector<std::coroutine_handle<>> running;
+};
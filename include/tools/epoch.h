@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <immintrin.h>
+
+// Epoch-based reclamation of nodes that optimistic readers may still hold. A thread
+// publishes the global epoch when it enters an operation, and a node unlinked at
+// epoch e is freed once every thread in an operation has entered after e.
+
+#define EPOCH_MAX_THREADS 100
+#define EPOCH_RETIRE_BATCH 64
+
+typedef void (*epoch_free_fn)(void *);
+
+typedef struct epoch_retired_s
+{
+    void *p;
+    uint64_t epoch;
+    epoch_free_fn fn;
+} epoch_retired_t;
+
+inline volatile uint64_t global_epoch = 1;
+inline volatile uint64_t epoch_active[EPOCH_MAX_THREADS][8]; // one cache line per thread, 0 when out of an operation
+
+// nodes left by the threads that have exited, adopted by the next epoch_reclaim()
+inline pthread_mutex_t epoch_orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+inline std::vector<epoch_retired_t> epoch_orphans;
+
+struct epoch_retired_list
+{
+    std::vector<epoch_retired_t> nodes;
+    ~epoch_retired_list()
+    {
+        pthread_mutex_lock(&epoch_orphans_lock);
+        epoch_orphans.insert(epoch_orphans.end(), nodes.begin(), nodes.end());
+        pthread_mutex_unlock(&epoch_orphans_lock);
+    }
+};
+inline thread_local epoch_retired_list epoch_retired;
+
+static inline void epoch_enter(int tid)
+{
+    epoch_active[tid][0] = global_epoch;
+    _mm_mfence();
+}
+
+static inline void epoch_exit(int tid)
+{
+    asm volatile("" ::: "memory");
+    epoch_active[tid][0] = 0;
+}
+
+static void epoch_reclaim()
+{
+    std::vector<epoch_retired_t> &nodes = epoch_retired.nodes;
+    if (!epoch_orphans.empty() && pthread_mutex_trylock(&epoch_orphans_lock) == 0)
+    {
+        nodes.insert(nodes.end(), epoch_orphans.begin(), epoch_orphans.end());
+        epoch_orphans.clear();
+        pthread_mutex_unlock(&epoch_orphans_lock);
+    }
+
+    uint64_t min_epoch = UINT64_MAX;
+    for (int i = 0; i < EPOCH_MAX_THREADS; i++)
+    {
+        uint64_t e = epoch_active[i][0];
+        if (e != 0 && e < min_epoch)
+            min_epoch = e;
+    }
+
+    size_t n = 0;
+    for (epoch_retired_t &r : nodes)
+    {
+        if (r.epoch >= min_epoch)
+            nodes[n++] = r;
+        else
+            r.fn(r.p);
+    }
+    nodes.resize(n);
+}
+
+// Free p with fn once no thread in an operation can hold it.
+static void epoch_retire(void *p, epoch_free_fn fn)
+{
+    epoch_retired.nodes.push_back({p, __sync_fetch_and_add(&global_epoch, 1), fn});
+    if (epoch_retired.nodes.size() >= EPOCH_RETIRE_BATCH)
+        epoch_reclaim();
+}
@@ -1,16 +1,27 @@
 #include "../util.h"
 
+static inline void log_file_path(char *str, int file_no)
+{
+    char suffix[100];
+
+    strcpy(str, NVM_FILE_PATH0);
+    sprintf(suffix, "log_file_%d", file_no);
+    strcat(str, suffix);
+}
+
 static inline char *log_file_create(uint64_t file_size)
 {
     char *tmp;
     size_t mapped_len;
     char str[100];
-    char suffix[100];
     int is_pmem;
 
-    strcpy(str, NVM_FILE_PATH0);
-    sprintf(suffix, "log_file_%d", log_file_cnt++);
-    strcat(str, suffix);
+    if (log_file_cnt >= LOG_MAX_FILES)
+    {
+        printf("too many log files!\n");
+        exit(1);
+    }
+    log_file_path(str, log_file_cnt);
 
     if ((tmp = (char *)pmem_map_file(str, file_size, PMEM_FILE_CREATE | PMEM_FILE_SPARSE, 0666, &mapped_len, &is_pmem)) == NULL)
     {
@@ -25,11 +36,29 @@ static inline char *log_file_create(uint64_t file_size)
 
     assert(tmp);
     memset(tmp, 0, file_size);
+
+    // the directory must know the file before any chunk of it is handed out.
+    log_file_base[log_file_cnt++] = tmp;
+    log_dir->file_cnt = log_file_cnt;
+    clflush(&(log_dir->file_cnt), sizeof(uint32_t));
+
     printf("..log_file_create end.\n");
     return tmp;
 }
 
-static inline log_chunk_t *get_log_chunk()
+static inline log_chunk_owner_t *get_chunk_owner(log_chunk_t *chunk)
+{
+    for (uint32_t i = 0; i < log_file_cnt; i++)
+    {
+        uint64_t off = (uintptr_t)chunk - (uintptr_t)log_file_base[i];
+        if (off < LOG_CHUNK_SIZE * LOG_FILE_SIZE)
+            return &(log_dir->owner[i][off / LOG_CHUNK_SIZE]);
+    }
+    assert(false && "the chunk is not in a log file");
+    return NULL;
+}
+
+static inline log_chunk_t *get_log_chunk(uint32_t group)
 {
     pthread_mutex_lock(&(global_log_chunks.lock));
     if (!global_log_chunks.head->next) // create a new log file.
@@ -53,23 +82,68 @@ static inline log_chunk_t *get_log_chunk()
     global_log_chunks.head->next = ret->next;
     pthread_mutex_unlock(&(global_log_chunks.lock));
     ret->next = NULL;
+
+    log_chunk_owner_t *owner = get_chunk_owner(ret);
+    owner->group = group;
+    owner->gen++;
+    owner->timestamp = log_now();
+    clflush(owner, sizeof(log_chunk_owner_t));
     return ret;
 }
 
-void add_log(uint64_t key, uint64_t value)
+// the seq of the i-th compact entry in a chunk, never 0.
+static inline uint16_t log_seq(uint16_t seq_base, uint64_t i)
+{
+    return (seq_base + i) % 65535 + 1;
+}
+
+// The seq is written last; an entry with a valid seq is complete even if its
+// cacheline is evicted in the middle.
+static inline void write_compact_entry(log_entry_compact_t *slot, uint64_t key, uint16_t seq, uint64_t value, uint16_t delta)
+{
+    uint64_t *w = (uint64_t *)slot;
+    w[1] = value | ((uint64_t)delta << 48);
+    asm volatile("" ::: "memory");
+    w[0] = key | ((uint64_t)seq << 48);
+}
+
+// Persist the pending entries of a log group with one flush sequence.
+// The caller holds vg->commit_lock.
+static inline void commit_group(vlog_group_t *vg)
+{
+    uint64_t lsn = vg->lsn; // read before commit_end, see add_log()
+    log_slot_t *end = vg->commit_end;
+
+    if (vg->commit_begin != end)
+    {
+        clflush_nofence(vg->commit_begin, (uintptr_t)end - (uintptr_t)vg->commit_begin);
+        fence();
+        vg->commit_begin = end;
+    }
+    if (lsn > vg->durable_lsn)
+        vg->durable_lsn = lsn;
+}
+
+// Return the log sequence number of the entry, see log_is_durable().
+uint64_t add_log(uint64_t key, uint64_t value)
 {
     uint32_t tid = thread_id;
     // std::cout << "--" << tid << "--" << key << " " << value << std::endl;
 
-    uint8_t alt = vlog_groups[tid]->alt;
-    vlog_t *vlog = &(vlog_groups[tid]->vlog[alt]);
+    vlog_group_t *vg = vlog_groups[tid];
+    uint8_t alt = vg->alt;
+    vlog_t *vlog = &(vg->vlog[alt]);
     log_chunk_t *tail = vlog->now_chunk;
     log_t *log = &(log_groups[tid]->log[alt]);
 
-    // empty log || current chunk has been run out
+    // empty log || current chunk has been run out (a compact entry may need a marker)
+#ifdef LOG_COMPACT_ENTRY
+    if (vlog->tot_size == 0 || vlog->entry_cnt + 2 >= LOG_ENTRYS_PER_CHUNK)
+#else
     if (vlog->tot_size == 0 || vlog->entry_cnt + 1 == LOG_ENTRYS_PER_CHUNK)
+#endif
     {
-        log_chunk_t *new_chunk = get_log_chunk();
+        log_chunk_t *new_chunk = get_log_chunk((tid << 1 | alt) + 1);
         tail->next = new_chunk;
         // new_chunk->next = NULL;
         //  new_chunk->next = log->head->next;
@@ -77,16 +151,127 @@ void add_log(uint64_t key, uint64_t value)
         vlog->now_chunk = new_chunk;
         vlog->tot_size += LOG_CHUNK_SIZE;
         vlog->entry_cnt = 0;
+        vlog->seq_base = get_chunk_owner(new_chunk)->gen % 65535;
     }
 
     log_chunk_t *lchunk = vlog->now_chunk;
     assert(vlog->entry_cnt < LOG_ENTRYS_PER_CHUNK);
-    lchunk->log_entries[vlog->entry_cnt].key = key;
-    lchunk->log_entries[vlog->entry_cnt].value = value;
-    lchunk->log_entries[vlog->entry_cnt].timestamp = _rdtsc();
-    clflush(&(lchunk->log_entries[vlog->entry_cnt]), LOG_ENTRY_SIZE, true);
+    log_slot_t *entry = &(lchunk->log_entries[vlog->entry_cnt]);
+
+    if (entry != vg->commit_end) // a new chunk, the pending entries are elsewhere
+    {
+        pthread_mutex_lock(&(vg->commit_lock));
+        commit_group(vg);
+        vg->commit_begin = vg->commit_end = entry;
+        pthread_mutex_unlock(&(vg->commit_lock));
+    }
+    uint64_t timestamp = log_now();
+    if (vg->commit_begin == entry)
+        vg->commit_begin_ts = timestamp;
 
+    int appended = 1;
+#ifdef LOG_COMPACT_ENTRY
+    assert(key <= LOG_COMPACT_MAX_KEY && value <= LOG_COMPACT_MAX_KEY);
+    if (vlog->entry_cnt == 0 || timestamp - vlog->last_timestamp >= LOG_DELTA_MARKER)
+    {
+        write_compact_entry(entry, timestamp & LOG_COMPACT_MAX_KEY, log_seq(vlog->seq_base, vlog->entry_cnt),
+                            timestamp >> 48, LOG_DELTA_MARKER);
+        vlog->last_timestamp = timestamp;
+        vlog->entry_cnt++;
+        entry++;
+        appended++;
+    }
+    write_compact_entry(entry, key, log_seq(vlog->seq_base, vlog->entry_cnt),
+                        value, timestamp - vlog->last_timestamp);
+    vlog->last_timestamp = timestamp;
+#else
+    entry->e.key = key;
+    entry->e.value = value;
+    asm volatile("" ::: "memory");
+    entry->e.timestamp = timestamp;
+#endif
     vlog->entry_cnt++;
+
+    // the entry is complete before it is published; lsn is published last, so that
+    // every entry counted by lsn is below commit_end.
+    asm volatile("" ::: "memory");
+    vg->commit_end = entry + 1;
+    uint64_t lsn = ++vg->lsn;
+
+    if (log_commit_window == 0 || vlog->entry_cnt % LOG_BATCH_ENTRIES < appended ||
+        timestamp - vg->commit_begin_ts >= log_commit_window)
+    {
+        pthread_mutex_lock(&(vg->commit_lock));
+        commit_group(vg);
+        pthread_mutex_unlock(&(vg->commit_lock));
+    }
+    return lsn;
+}
+
+void log_set_commit_window(uint64_t window_ns)
+{
+    log_commit_window_ns = window_ns;
+    if (window_ns == 0)
+    {
+        log_commit_window = 0;
+        return;
+    }
+
+    // convert to timestamp units
+    uint64_t time_start = NowNanos();
+    uint64_t ts_start = log_now();
+    usleep(10000);
+    uint64_t units = log_now() - ts_start;
+    log_commit_window = (uint64_t)((double)units / ElapsedNanos(time_start) * window_ns);
+    if (log_commit_window == 0)
+        log_commit_window = 1;
+}
+
+// Persist the pending entries of the calling thread.
+void log_commit()
+{
+    vlog_group_t *vg = vlog_groups[thread_id];
+    if (vg->durable_lsn == vg->lsn)
+        return;
+    pthread_mutex_lock(&(vg->commit_lock));
+    commit_group(vg);
+    pthread_mutex_unlock(&(vg->commit_lock));
+}
+
+// Persist the pending entries of every thread.
+void log_commit_all()
+{
+    for (int i = 0; i < num_log_groups; i++)
+    {
+        vlog_group_t *vg = vlog_groups[i];
+        pthread_mutex_lock(&(vg->commit_lock));
+        commit_group(vg);
+        pthread_mutex_unlock(&(vg->commit_lock));
+    }
+}
+
+// Persist the pending entries that are older than the durability window, for the
+// threads that stopped appending.  Called by the background thread.
+void log_commit_expired()
+{
+    uint64_t now = log_now();
+    for (int i = 0; i < num_log_groups; i++)
+    {
+        vlog_group_t *vg = vlog_groups[i];
+        if (vg->durable_lsn == vg->lsn)
+            continue;
+        if (pthread_mutex_trylock(&(vg->commit_lock)) != 0)
+            continue;
+        if (vg->commit_begin != vg->commit_end && now - vg->commit_begin_ts >= log_commit_window)
+            commit_group(vg);
+        pthread_mutex_unlock(&(vg->commit_lock));
+    }
+}
+
+// Whether the entry of the calling thread with the log sequence number lsn is persisted.
+bool log_is_durable(uint64_t lsn)
+{
+    return vlog_groups[thread_id]->durable_lsn >= lsn;
 }
 
 void log_vlog_init(log_t &log, vlog_t &vlog, bool is_first)
@@ -106,7 +291,7 @@ void log_vlog_init(log_t &log, vlog_t &vlog, bool is_first)
 uint64_t get_log_totsize()
 {
     uint64_t tot_size = 0;
-    for (int i = 0; i <= num_threads; i++)
+    for (int i = 0; i < num_log_groups; i++)
     {
         vlog_t *vlog = &(vlog_groups[i]->vlog[vlog_groups[i]->alt]);
         if (vlog->tot_size > 0)
@@ -118,7 +303,7 @@ uint64_t get_log_totsize()
 uint64_t get_flush_totnum()
 {
     uint64_t tot_num = 0;
-    for (int i = 0; i <= num_threads; i++)
+    for (int i = 0; i < num_log_groups; i++)
     {
         tot_num += vlog_groups[i]->flushed_count[vlog_groups[i]->alt];
     }
@@ -135,6 +320,9 @@ void switch_alt_and_init(int i)
     vlog_groups[i]->alt = alt;
     log_groups[i]->alt = alt;
     clflush(log_groups[i], sizeof(log_group_t));
+
+    log_dir->alt[i] = alt;
+    clflush(&(log_dir->alt[i]), sizeof(uint8_t));
 }
 
 void collect_old_log_to_freelist(int i)
@@ -148,6 +336,16 @@ void collect_old_log_to_freelist(int i)
         log_t *log = &(log_groups[i]->log[x]);
         log_chunk_t *tail = vlog->now_chunk;
 
+        for (log_chunk_t *chunk = log->head->next;; chunk = chunk->next)
+        {
+            log_chunk_owner_t *owner = get_chunk_owner(chunk);
+            owner->group = 0;
+            clflush_nofence(owner, sizeof(log_chunk_owner_t));
+            if (chunk == tail)
+                break;
+        }
+        fence();
+
         pthread_mutex_lock(&(global_log_chunks.lock));
         tail->next = global_log_chunks.head->next;
         global_log_chunks.head->next = log->head->next;
@@ -155,4 +353,171 @@ void collect_old_log_to_freelist(int i)
 
         vlog->tot_size = 0;
     }
-}
\ No newline at end of file
+}
+
+// Start the timestamps of this run above every timestamp of the previous runs.
+static void log_new_epoch()
+{
+    log_dir->epoch++;
+    clflush(&(log_dir->epoch), sizeof(uint64_t));
+    log_ts_base = (log_dir->epoch & ((1ULL << (64 - LOG_TS_CYCLE_BITS)) - 1)) << LOG_TS_CYCLE_BITS;
+    log_tsc_open = _rdtsc();
+}
+
+// Open the log directory. A new one is created unless is_recovery is set and the
+// directory of the previous run is valid; then its log files are mapped again, the
+// chunks without an owner go to the free list and the others are kept for the replay.
+void log_dir_open(bool is_recovery)
+{
+    char str[100];
+    size_t mapped_len;
+    int is_pmem;
+
+    strcpy(str, NVM_FILE_PATH0);
+    strcat(str, "log_dir");
+
+    if (is_recovery)
+    {
+        log_dir = (log_dir_t *)pmem_map_file(str, 0, 0, 0666, &mapped_len, &is_pmem);
+        if (log_dir && mapped_len == sizeof(log_dir_t) && log_dir->magic == LOG_DIR_MAGIC &&
+            log_dir->entry_size != LOG_ENTRY_SIZE)
+        {
+            printf("the logs have %u-byte entries, rebuild with the same log entry format to recover.\n", log_dir->entry_size);
+            exit(1);
+        }
+        if (log_dir && (mapped_len != sizeof(log_dir_t) || log_dir->magic != LOG_DIR_MAGIC))
+        {
+            pmem_unmap(log_dir, mapped_len);
+            log_dir = NULL;
+        }
+        if (log_dir == NULL)
+        {
+            printf("no valid log directory, start with empty logs.\n");
+            is_recovery = false;
+        }
+    }
+
+    if (!is_recovery)
+    {
+        if ((log_dir = (log_dir_t *)pmem_map_file(str, sizeof(log_dir_t), PMEM_FILE_CREATE, 0666, &mapped_len, &is_pmem)) == NULL)
+        {
+            printf("map log directory fail! %d\n", errno);
+            exit(1);
+        }
+        // the epochs go on from a previous directory, its leaf nodes may be recovered later
+        uint64_t epoch = (mapped_len == sizeof(log_dir_t) && log_dir->magic == LOG_DIR_MAGIC) ? log_dir->epoch : 0;
+        memset(log_dir, 0, sizeof(log_dir_t));
+        log_dir->entry_size = LOG_ENTRY_SIZE;
+        log_dir->epoch = epoch;
+        clflush(log_dir, sizeof(log_dir_t));
+        log_dir->magic = LOG_DIR_MAGIC;
+        clflush(log_dir, sizeof(uint64_t));
+        log_new_epoch();
+        return;
+    }
+    log_new_epoch();
+
+    for (uint32_t i = 0; i < log_dir->file_cnt; i++)
+    {
+        log_file_path(str, i);
+        char *base = (char *)pmem_map_file(str, 0, 0, 0666, &mapped_len, &is_pmem);
+        if (base == NULL || mapped_len != LOG_CHUNK_SIZE * LOG_FILE_SIZE)
+        {
+            printf("map log file %d fail! %d\n", i, errno);
+            exit(1);
+        }
+        log_file_base[i] = base;
+
+        for (int j = LOG_FILE_SIZE - 1; j >= 0; j--)
+        {
+            if (log_dir->owner[i][j].group == 0)
+            {
+                log_chunk_t *chunk = (log_chunk_t *)(base + j * LOG_CHUNK_SIZE);
+                chunk->next = global_log_chunks.head->next;
+                global_log_chunks.head->next = chunk;
+            }
+        }
+    }
+    log_file_cnt = log_dir->file_cnt;
+}
+
+// owned chunks collected by log_collect_for_replay(), freed after the replay.
+static std::vector<log_chunk_t *> replayed_chunks;
+
+// Collect the entries of every owned log chunk, whether its owner is a thread of this
+// process or of the crashed one, and detach the chunks from the thread logs so that
+// the replay logs into new chunks without overwriting them.
+uint64_t log_collect_for_replay(std::vector<log_entry_t> &entries)
+{
+    for (int i = 0; i < num_log_groups; i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            log_vlog_init(log_groups[i]->log[j], vlog_groups[i]->vlog[j], false);
+            vlog_groups[i]->flushed_count[j] = 0;
+        }
+        vlog_groups[i]->alt = 0;
+        log_groups[i]->alt = 0;
+        clflush(log_groups[i], sizeof(log_group_t));
+        log_dir->alt[i] = 0;
+    }
+    clflush(log_dir->alt, sizeof(log_dir->alt));
+
+    uint64_t cnt = 0;
+    for (uint32_t i = 0; i < log_file_cnt; i++)
+    {
+        for (int j = 0; j < LOG_FILE_SIZE; j++)
+        {
+            log_chunk_owner_t *owner = &(log_dir->owner[i][j]);
+            if (owner->group == 0)
+                continue;
+
+            log_chunk_t *chunk = (log_chunk_t *)(log_file_base[i] + j * LOG_CHUNK_SIZE);
+#ifdef LOG_COMPACT_ENTRY
+            // stop at the first entry whose seq does not match, it is left from a previous owner.
+            uint16_t seq_base = owner->gen % 65535;
+            uint64_t timestamp = 0;
+            for (uint64_t k = 0; k < LOG_ENTRYS_PER_CHUNK - 1; k++)
+            {
+                log_entry_compact_t *e = &(chunk->log_entries[k]);
+                if (e->seq != log_seq(seq_base, k) || (k == 0 && e->delta != LOG_DELTA_MARKER))
+                    break;
+                if (e->delta == LOG_DELTA_MARKER)
+                {
+                    timestamp = e->key | ((uint64_t)e->value << 48);
+                    continue;
+                }
+                timestamp += e->delta;
+                entries.push_back(log_entry_t{e->key, e->value, timestamp});
+                cnt++;
+            }
+#else
+            // entries are appended in timestamp order, an older one is left from a previous owner.
+            uint64_t n = 0;
+            while (n < LOG_ENTRYS_PER_CHUNK - 1 && chunk->log_entries[n].e.timestamp >= owner->timestamp)
+                entries.push_back(chunk->log_entries[n++].e);
+            cnt += n;
+#endif
+
+            replayed_chunks.push_back(chunk);
+        }
+    }
+    return cnt;
+}
+
+void log_release_replayed()
+{
+    pthread_mutex_lock(&(global_log_chunks.lock));
+    for (auto chunk : replayed_chunks)
+    {
+        log_chunk_owner_t *owner = get_chunk_owner(chunk);
+        owner->group = 0;
+        clflush_nofence(owner, sizeof(log_chunk_owner_t));
+
+        chunk->next = global_log_chunks.head->next;
+        global_log_chunks.head->next = chunk;
+    }
+    fence();
+    pthread_mutex_unlock(&(global_log_chunks.lock));
+    replayed_chunks.clear();
+}
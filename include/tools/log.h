@@ -1,6 +1,8 @@
 #pragma once
 
 typedef struct log_entry_s log_entry_t;
+typedef struct log_entry_full_s log_entry_full_t;
+typedef struct log_entry_compact_s log_entry_compact_t;
 typedef struct log_chunk_s log_chunk_t;
 typedef struct log_s log_t;
 typedef struct vlog_s vlog_t;
@@ -8,15 +10,57 @@ typedef struct log_group_s log_group_t;
 typedef struct vlog_group_s vlog_group_t;
 typedef struct free_log_chunks_s free_log_chunks_t;
 typedef struct log_file_s log_file_t;
+typedef struct log_chunk_owner_s log_chunk_owner_t;
+typedef struct log_dir_s log_dir_t;
 
-#define LOG_ENTRY_SIZE (sizeof(log_entry_t))
+// the format of the entries in log chunks, see log_entry_compact_s
+// #define LOG_COMPACT_ENTRY
+
+#ifdef LOG_COMPACT_ENTRY
+typedef log_entry_compact_t log_slot_t;
+#else
+typedef log_entry_full_t log_slot_t;
+#endif
+
+#define LOG_ENTRY_SIZE (sizeof(log_slot_t))
 
 #define LOG_CHUNK_SIZE (4194304ULL) // 4MB
 
-#define LOG_ENTRYS_PER_CHUNK 174762 //(4194304-8)/24
+#define XPLINE_SIZE 256 // the write unit of Optane DCPMM
+
+#ifdef LOG_COMPACT_ENTRY
+#define LOG_ENTRYS_PER_CHUNK 262128 //(4194304-256)/16
+#define LOG_BATCH_ENTRIES 16        // 16 entries fill an XPLine
+#else
+#define LOG_ENTRYS_PER_CHUNK 131064 //(4194304-256)/32
+#define LOG_BATCH_ENTRIES 32        // 32 entries fill 4 XPLines
+#endif
+
+#define LOG_COMPACT_MAX_KEY ((1ULL << 48) - 1) // also the max value
+#define LOG_DELTA_MARKER 0xffff
+
+// Group commit: the entries of a thread are persisted together when a batch of
+// LOG_BATCH_ENTRIES is full, or when the oldest one is older than the durability
+// window. 0 persists every entry before add_log() returns.
+#ifndef LOG_COMMIT_WINDOW_NS
+#define LOG_COMMIT_WINDOW_NS 0
+#endif
 
 #define LOG_FILE_SIZE 1200 // the number of chunks in a log file
 
+#define LOG_MAX_FILES 64   // the number of log files tracked by the log directory
+#define LOG_MAX_GROUPS 100 // the same as the size of log_groups[]
+
+#define LOG_DIR_MAGIC 0x4c4f474449523032ULL // "LOGDIR02"
+
+// Log and leaf timestamps, see log_now(): the epoch of the log directory, bumped on
+// every open, above the TSC cycles since the open in units of 1 << LOG_TS_SHIFT. The
+// TSC starts over after a power cycle, the epoch keeps the timestamps growing. A run
+// may last 2^(LOG_TS_CYCLE_BITS + LOG_TS_SHIFT) cycles (~270 days at 3GHz), and the
+// epochs wrap after 2^12 opens.
+#define LOG_TS_SHIFT 4
+#define LOG_TS_CYCLE_BITS 52
+
 struct log_entry_s
 {
     uint64_t key;
@@ -24,10 +68,34 @@ struct log_entry_s
     uint64_t timestamp;
 };
 
+// A log_entry_s padded to 2 entries per cacheline, so that no entry spans two lines.
+// The timestamp is written last; an entry with a valid timestamp is complete even if
+// its cacheline is evicted in the middle, see log_collect_for_replay().
+struct log_entry_full_s
+{
+    log_entry_t e;
+    uint64_t padding;
+};
+
+// 4 entries per cacheline. Keys and values are limited to 48 bits.
+// seq is the position in the chunk plus a base that changes every time the chunk
+// is handed out, so an entry left by a previous owner does not match.
+// The timestamp is delta cycles after the previous entry of the chunk; a marker
+// entry (delta == LOG_DELTA_MARKER) holds a full timestamp in key | value << 48.
+// Every chunk starts with a marker, and a marker is added when a delta overflows.
+struct log_entry_compact_s
+{
+    uint64_t key : 48;
+    uint64_t seq : 16;
+    uint64_t value : 48;
+    uint64_t delta : 16;
+};
+
 struct log_chunk_s
 {
     log_chunk_t *next;
-    log_entry_t log_entries[0];
+    char padding[XPLINE_SIZE - sizeof(log_chunk_t *)]; // entries start at an XPLine boundary
+    log_slot_t log_entries[0];
 };
 
 struct log_s
@@ -40,6 +108,8 @@ struct vlog_s
     log_chunk_t *now_chunk;
     uint64_t tot_size;
     uint64_t entry_cnt;
+    uint64_t last_timestamp; // LOG_COMPACT_ENTRY
+    uint16_t seq_base;       // LOG_COMPACT_ENTRY
 };
 
 struct log_group_s
@@ -53,6 +123,37 @@ struct vlog_group_s
     uint8_t alt;
     vlog_t vlog[2];
     uint64_t flushed_count[2];
+
+    // group commit: [commit_begin, commit_end) are appended but not persisted yet.
+    log_slot_t *commit_begin;
+    log_slot_t *volatile commit_end;
+    uint64_t commit_begin_ts; // the timestamp of *commit_begin
+    volatile uint64_t lsn;         // the number of entries appended
+    volatile uint64_t durable_lsn; // the number of entries persisted
+    pthread_mutex_t commit_lock;
+};
+
+// The owner of a log chunk. It is set when the chunk is handed out to a thread and
+// cleared when the chunk goes back to the free list.
+struct log_chunk_owner_s
+{
+    uint32_t group; // 0: free, otherwise (thread id << 1 | alt) + 1
+    uint32_t gen;   // how many times the chunk has been handed out
+    uint64_t timestamp; // entries older than it were written by a previous owner
+};
+
+// The persistent log directory (the "log_dir" file next to the log files).
+// With the chunk owners, every log entry that may still be needed after a crash
+// can be found without the DRAM log heads.
+struct log_dir_s
+{
+    uint64_t magic;
+    uint32_t file_cnt;
+    uint32_t entry_size; // LOG_ENTRY_SIZE of the run that created the directory
+    uint64_t epoch;      // how many times the directory has been opened
+    uint8_t alt[LOG_MAX_GROUPS];
+    uint8_t padding[128 - 24 - LOG_MAX_GROUPS]; // keep every owner in one cache line
+    log_chunk_owner_t owner[LOG_MAX_FILES][LOG_FILE_SIZE];
 };
 
 struct free_log_chunks_s
@@ -61,10 +162,20 @@ struct free_log_chunks_s
     pthread_mutex_t lock;
 };
 
-void add_log(uint64_t key, uint64_t value);
+uint64_t add_log(uint64_t key, uint64_t value);
 void log_vlog_init(log_t &log, vlog_t &vlog, bool is_first);
 uint64_t get_log_totsize();
 uint64_t get_flush_totnum();
 
+void log_set_commit_window(uint64_t window_ns);
+void log_commit();
+void log_commit_all();
+void log_commit_expired();
+bool log_is_durable(uint64_t lsn);
+
 void switch_alt_and_init(int i);
 void collect_old_log_to_freelist(int i);
+
+void log_dir_open(bool is_recovery);
+uint64_t log_collect_for_replay(std::vector<log_entry_t> &entries);
+void log_release_replayed();
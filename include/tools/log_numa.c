@@ -61,7 +61,7 @@ void threadLogPool::add_log(uint64_t key, uint64_t value)
     assert(vlog->entry_cnt < LOG_ENTRYS_PER_CHUNK);
     lchunk->log_entries[vlog->entry_cnt].key = key;
     lchunk->log_entries[vlog->entry_cnt].value = value;
-    lchunk->log_entries[vlog->entry_cnt].timestamp = _rdtsc();
+    lchunk->log_entries[vlog->entry_cnt].timestamp = log_now();
     //  = {key, value, _rdtsc()};
     clflush(&(lchunk->log_entries[vlog->entry_cnt]), LOG_ENTRY_SIZE, true);
 
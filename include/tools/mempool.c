@@ -109,6 +109,13 @@ threadNVMPools::~threadNVMPools()
     }
 }
 
+static void persist_header(void *addr, size_t len)
+{
+#ifdef NVMPOOL_REAL
+    pmem_persist(addr, len);
+#endif
+}
+
 /**
  * get the sigbus signal
  */
@@ -121,7 +128,7 @@ static void handleSigbus(int sig)
 void threadNVMPools::init(int num_workers, const char *nvm_file, long long size)
 {
     // map_addr must be 4KB aligned, size must be multiple of 4KB
-    assert((num_workers > 0) && (size > 0) && (size % 4096 == 0));
+    assert((num_workers > 0) && (size > NVMPOOL_HEADER_SIZE) && (size % 4096 == 0));
 
     // set sigbus handler
     signal(SIGBUS, handleSigbus);
@@ -137,9 +144,9 @@ void threadNVMPools::init(int num_workers, const char *nvm_file, long long size)
 
     tn_nvm_file = nvm_file;
 
-    long long size_per_pool = (size / tm_num_workers / 4096) * 4096;
+    long long size_per_pool = ((size - NVMPOOL_HEADER_SIZE) / tm_num_workers / 4096) * 4096;
     size_per_pool = (size_per_pool < MB ? MB : size_per_pool);
-    tm_size = size_per_pool * tm_num_workers;
+    tm_size = NVMPOOL_HEADER_SIZE + size_per_pool * tm_num_workers;
 
 #ifdef NVMPOOL_REAL
 
@@ -179,7 +186,7 @@ void threadNVMPools::init(int num_workers, const char *nvm_file, long long size)
     for (int i = 0; i < tm_num_workers; i++)
     {
         sprintf(name, "NVM pool %d", i);
-        tm_pools[i].init(tm_buf + i * size_per_pool, size_per_pool, 4096, strdup(name));
+        tm_pools[i].init(tm_buf + NVMPOOL_HEADER_SIZE + i * size_per_pool, size_per_pool, 4096, strdup(name));
     }
 #ifdef TOUCH_PMEM_POOL
     // 3. touch every page to make sure that they are allocated
@@ -188,6 +195,104 @@ void threadNVMPools::init(int num_workers, const char *nvm_file, long long size)
         tm_buf[i] = 1; // XXX: need a special signature
     }
 #endif
+
+    // 4. write the pool header, the magic number is persisted last
+    tn_header = (nvmPoolHeader *)tm_buf;
+    tn_reloc = 0;
+    memset(tn_header, 0, NVMPOOL_HEADER_SIZE);
+    tn_header->num_workers = tm_num_workers;
+    tn_header->size_per_pool = size_per_pool;
+    tn_header->base = (uint64_t)tm_buf;
+    persist_header(tn_header, NVMPOOL_HEADER_SIZE);
+    tn_header->magic = NVMPOOL_MAGIC;
+    persist_header(&(tn_header->magic), sizeof(uint64_t));
+}
+
+bool threadNVMPools::recover(int num_workers, const char *nvm_file)
+{
+    signal(SIGBUS, handleSigbus);
+
+    tn_nvm_file = nvm_file;
+
+#ifdef NVMPOOL_REAL
+    int is_pmem = false;
+    size_t mapped_len = 0;
+
+    // len = 0: map the whole existing file
+    tm_buf = (char *)pmem_map_file(tn_nvm_file, 0, 0, 0666, &mapped_len, &is_pmem);
+    if (tm_buf == NULL || is_pmem == false)
+    {
+        perror("pmem_map_file");
+        return false;
+    }
+    tm_size = mapped_len;
+#else
+    fprintf(stderr, "Error: recovery needs NVMPOOL_REAL\n");
+    return false;
+#endif
+
+    tn_header = (nvmPoolHeader *)tm_buf;
+    if (tn_header->magic != NVMPOOL_MAGIC ||
+        NVMPOOL_HEADER_SIZE + tn_header->num_workers * tn_header->size_per_pool != tm_size)
+    {
+        fprintf(stderr, "Error: %s is not a valid NVM pool\n", tn_nvm_file);
+        pmem_unmap(tm_buf, tm_size);
+        tm_buf = NULL;
+        return false;
+    }
+    if ((uint64_t)num_workers > tn_header->num_workers)
+    {
+        fprintf(stderr, "Error: %s was created for %lu workers\n", tn_nvm_file, tn_header->num_workers);
+        pmem_unmap(tm_buf, tm_size);
+        tm_buf = NULL;
+        return false;
+    }
+
+    printf("NVM mapping address: %p, size: %lld, previous address: %p\n", tm_buf, tm_size, (void *)tn_header->base);
+    tn_reloc = (long long)tm_buf - (long long)tn_header->base;
+
+    // every recorded pool is re-opened, even if fewer workers are used now,
+    // so that nodes allocated by the missing workers can still be accounted.
+    tm_num_workers = tn_header->num_workers;
+    tm_pools = new mempool[tm_num_workers];
+
+    char name[80];
+    for (int i = 0; i < tm_num_workers; i++)
+    {
+        sprintf(name, "NVM pool %d", i);
+        tm_pools[i].init(tm_buf + NVMPOOL_HEADER_SIZE + i * tn_header->size_per_pool, tn_header->size_per_pool, 4096, strdup(name));
+    }
+    return true;
+}
+
+void threadNVMPools::commit_relocation(void)
+{
+    if (tn_reloc == 0)
+        return;
+    tn_header->base = (uint64_t)tm_buf;
+    persist_header(&(tn_header->base), sizeof(uint64_t));
+    tn_reloc = 0;
+}
+
+int threadNVMPools::mark_used(void *p, unsigned long long size)
+{
+    int i = pool_of(p);
+    if (i >= 0)
+        tm_pools[i].mark_used(p, size);
+    return i;
+}
+
+void threadNVMPools::free_node(void *p)
+{
+    tm_pools[pool_of(p)].free_node_shared(p);
+}
+
+long long threadNVMPools::recover_free_nodes(unsigned long long size)
+{
+    long long cnt = 0;
+    for (int i = 0; i < tm_num_workers; i++)
+        cnt += tm_pools[i].recover_free_nodes(size);
+    return cnt;
 }
 
 void threadNVMPools::print(void)
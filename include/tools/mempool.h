@@ -42,6 +42,7 @@
 #include <signal.h>
 #include <string.h>
 #include <malloc.h>
+#include <stdint.h>
 
 /* -------------------------------------------------------------- */
 /* NVMPOOL_REAL: use pmdk to map NVM
@@ -64,6 +65,26 @@
 
 #define TOUCH_PMEM_POOL
 
+/**
+ * nvmPoolHeader: the first 4KB of the NVM file.
+ *
+ * It records the pool geometry and the address at which the file was
+ * mapped, so that a restarted process can re-open the pools and rebase
+ * the absolute pointers stored in NVM.  The rest of the 4KB is reserved
+ * for the index (e.g. the pointer to its first leaf node).
+ */
+#define NVMPOOL_HEADER_SIZE 4096
+#define NVMPOOL_MAGIC 0x4e564d504f4f4c31ULL // "NVMPOOL1"
+
+typedef struct nvmPoolHeader
+{
+   uint64_t magic;
+   uint64_t num_workers;
+   uint64_t size_per_pool;
+   uint64_t base; // mapping address of the file when it was last opened
+   char root[NVMPOOL_HEADER_SIZE - 4 * sizeof(uint64_t)];
+} nvmPoolHeader;
+
 /**
  * mempool: allocate memory using malloc-like calls then manage the memory
  *          by itself
@@ -77,6 +98,10 @@ private:
    char *mempool_cur;
    char *mempool_end;
    char *mempool_free_node;
+   char *volatile mempool_shared_free; // nodes freed by any thread, see free_node_shared()
+   volatile long long mempool_free_cnt; // nodes on the free lists
+   long long mempool_node_size;  // the size of the nodes served by alloc_node()
+   unsigned char *mempool_used_map; // nodes found during crash recovery, see mark_used()
    const char *mempool_name;
 
 public:
@@ -91,6 +116,10 @@ public:
    {
       mempool_start = mempool_cur = mempool_end = NULL;
       mempool_free_node = NULL;
+      mempool_shared_free = NULL;
+      mempool_free_cnt = 0;
+      mempool_node_size = 0;
+      mempool_used_map = NULL;
    }
 
    /**
@@ -114,6 +143,10 @@ public:
       mempool_cur = mempool_start;
       mempool_end = mempool_start + size;
       mempool_free_node = NULL;
+      mempool_shared_free = NULL;
+      mempool_free_cnt = 0;
+      mempool_node_size = 0;
+      mempool_used_map = NULL;
 
       mempool_name = name;
    }
@@ -148,9 +181,65 @@ public:
              mempool_name, ((double)mempool_size) / MB, ((double)used) / MB, ff); 
    }
 
+   /**
+   * the space in use, without the nodes on the free list
+   */
    long long get_used_space()
    {
-      return (mempool_cur - mempool_start);
+      return (mempool_cur - mempool_start) - mempool_free_cnt * mempool_node_size;
+   }
+
+   /**
+   * check whether p is allocated from this memory pool
+   */
+   bool contains(void *p)
+   {
+      return ((char *)p >= mempool_start) && ((char *)p < mempool_end);
+   }
+
+   /**
+   * account a node found during crash recovery as allocated.
+   *
+   * @param p     an address in the node
+   * @param size  the size of the node
+   *
+   * Everything below the node is treated as allocated until recover_free_nodes().
+   */
+   void mark_used(void *p, unsigned long long size)
+   {
+      long long i = ((char *)p - mempool_start) / size;
+      char *node = mempool_start + i * size;
+      if (node + size > mempool_cur)
+         mempool_cur = node + size;
+
+      long long n = mempool_size / size;
+      if (mempool_used_map == NULL)
+         mempool_used_map = (unsigned char *)calloc((n + 7) / 8, 1);
+      mempool_used_map[i / 8] |= (1 << (i % 8));
+   }
+
+   /**
+   * put the nodes below mempool_cur that no mark_used() has found on the free list,
+   * i.e. the nodes freed before the crash and the ones not yet linked into the index.
+   *
+   * @param size  the size of the nodes, the pool must only serve nodes of this size
+   * @return the number of free nodes
+   */
+   long long recover_free_nodes(unsigned long long size)
+   {
+      long long n = (mempool_cur - mempool_start) / size;
+      long long cnt = 0;
+      mempool_node_size = size;
+      for (long long i = n - 1; i >= 0; i--)
+      {
+         if (mempool_used_map && (mempool_used_map[i / 8] & (1 << (i % 8))))
+            continue;
+         free_node(mempool_start + i * size);
+         cnt++;
+      }
+      ::free(mempool_used_map);
+      mempool_used_map = NULL;
+      return cnt;
    }
 
 public:
@@ -203,11 +292,17 @@ public:
    */
    void *alloc_node(int size)
    {
+      mempool_node_size = size;
+      if (!mempool_free_node && mempool_shared_free)
+         mempool_free_node = __sync_lock_test_and_set(&mempool_shared_free, (char *)NULL);
       if (mempool_free_node)
       {
          register char *p;
          p = mempool_free_node;
          mempool_free_node = *((char **)p);
+         __sync_fetch_and_sub(&mempool_free_cnt, 1);
+
+         memset(p, 0, size);
          return (void *)p;
       }
       else
@@ -225,6 +320,24 @@ public:
    {
       *((char **)p) = mempool_free_node;
       mempool_free_node = (char *)p;
+      __sync_fetch_and_add(&mempool_free_cnt, 1);
+   }
+
+   /**
+   * free a btree node from any thread; the thread that owns the pool takes the
+   * nodes over in alloc_node()
+   *
+   * @param p btree node to free
+   */
+   void free_node_shared(void *p)
+   {
+      char *head;
+      do
+      {
+         head = mempool_shared_free;
+         *((char **)p) = head;
+      } while (!__sync_bool_compare_and_swap(&mempool_shared_free, head, (char *)p));
+      __sync_fetch_and_add(&mempool_free_cnt, 1);
    }
 
    /**
@@ -329,6 +442,9 @@ public:
 
    const char *tn_nvm_file;
 
+   nvmPoolHeader *tn_header; /* the first 4KB of tm_buf */
+   long long tn_reloc;       /* tm_buf - the address recorded in tn_header */
+
 public:
    /**
    * constructor
@@ -340,6 +456,8 @@ public:
       tm_buf = NULL;
       tm_size = 0;
       tn_nvm_file = NULL;
+      tn_header = NULL;
+      tn_reloc = 0;
    }
 
    /**
@@ -357,6 +475,64 @@ public:
    */
    void init(int num_workers, const char *nvm_file, long long size = 20 * MB);
 
+   /**
+   * Re-open the NVM memory pools of an existing file after a restart.
+   * The pools are left empty; the caller walks its persistent nodes and
+   * calls mark_used() for each of them.
+   *
+   * @param num_workers  number of parallel worker threads, must not exceed
+   *                     the number of pools recorded in the file
+   * @param nvm_file     the nvm file name to map
+   * @return false if the file does not contain a valid pool
+   */
+   bool recover(int num_workers, const char *nvm_file);
+
+   /**
+   * the area reserved for the index in the first 4KB
+   */
+   char *get_root() { return tn_header->root; }
+
+   /**
+   * translate a pointer stored in NVM before the restart into the current mapping
+   */
+   void *relocate(uint64_t p) { return p ? (void *)(p + tn_reloc) : NULL; }
+
+   /**
+   * record the current mapping address once all stored pointers are rebased
+   */
+   void commit_relocation(void);
+
+   /**
+   * the index of the pool p is allocated from, i.e. the worker that owns it
+   *
+   * @return -1 if p is outside the NVM file
+   */
+   int pool_of(void *p)
+   {
+      if ((char *)p < tm_buf + NVMPOOL_HEADER_SIZE || (char *)p >= tm_buf + tm_size)
+         return -1;
+      return ((char *)p - tm_buf - NVMPOOL_HEADER_SIZE) / tn_header->size_per_pool;
+   }
+
+   /**
+   * account a recovered node in the pool it was allocated from
+   *
+   * @return the index of the pool, or -1 if p is outside the NVM file
+   */
+   int mark_used(void *p, unsigned long long size);
+
+   /**
+   * free a node to the pool it was allocated from, whichever thread frees it
+   */
+   void free_node(void *p);
+
+   /**
+   * rebuild the free lists of all pools once every recovered node is marked
+   *
+   * @return the number of free nodes
+   */
+   long long recover_free_nodes(unsigned long long size);
+
    void print(void);
 
    /**
@@ -388,7 +564,7 @@ extern threadNVMPools the_thread_nvmpools;
 #define nvmpool_alloc the_nvmpool.alloc
 #define nvmpool_free the_nvmpool.free
 #define nvmpool_alloc_node the_nvmpool.alloc_node
-#define nvmpool_free_node the_nvmpool.free_node
+#define nvmpool_free_node the_thread_nvmpools.free_node
 
 /* -------------------------------------------------------------- */
 #endif /* _BTREE_MEM_POOL_H */
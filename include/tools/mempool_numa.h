@@ -231,6 +231,8 @@ public:
          register char *p;
          p = mempool_free_node;
          mempool_free_node = *((char **)p);
+
+         memset(p, 0, size);
          return (void *)p;
       }
       else
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <climits>
+#include <functional>
+
+// Variable-length string keys of CCL-BTree-FF (STRING_KEY). A key takes 8 bytes like an
+// integer key: the first 15 bits of the string above a 47-bit reference to its body.
+// Keys compare by these bits first, and by their bodies only if the bits are equal. The
+// bits tell apart keys far from each other, in the upper levels of the tree; neighbours
+// in a leaf node or a last-level page mostly share them and compare by their bodies.
+// The body of a key in the tree is in NVM and is referenced by its offset in the NVM
+// pool, so the keys in leaf nodes and logs stay valid wherever the pool is mapped. The
+// body of a key passed by a caller is referenced by its address (STR_KEY_ADDR).
+// 0 and LONG_MAX are the smallest and the largest key, they have no body.
+
+#define STR_KEY_MAX_LEN 255
+#define STR_KEY_REF_BITS 47
+#define STR_KEY_REF_MASK ((1ULL << STR_KEY_REF_BITS) - 1)
+#define STR_KEY_ADDR (1ULL << STR_KEY_REF_BITS)
+#define STR_KEY_PREFIX_SHIFT (STR_KEY_REF_BITS + 1)
+
+typedef struct str_key_body
+{
+    uint8_t len;
+    uint8_t fgpt; // the fingerprint of the key in leaf nodes, from the whole string
+    char key[0];
+} str_key_body;
+
+static inline uint64_t str_key_hash(const char *s, int len)
+{
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    return h;
+}
+
+class str_key
+{
+public:
+    uint64_t raw;
+
+    str_key() = default;
+    str_key(long raw) : raw(raw) {}
+
+    // s[0..len) in body, which must have room for len bytes after the header
+    str_key(str_key_body *body, const char *s, int len)
+    {
+        uint64_t h = str_key_hash(s, len);
+        body->len = len;
+        body->fgpt = (uint8_t)(h ^ (h >> 32) ^ (h >> 16) ^ (h >> 8));
+        memcpy(body->key, s, len);
+        raw = (prefix_of(body) << STR_KEY_PREFIX_SHIFT) | STR_KEY_ADDR | (uint64_t)body;
+    }
+
+    bool has_body() const { return raw != 0 && raw != LONG_MAX; }
+    bool in_nvm() const { return !(raw & STR_KEY_ADDR); }
+
+    str_key_body *body() const
+    {
+        uint64_t ref = raw & STR_KEY_REF_MASK;
+        return (str_key_body *)(in_nvm() ? the_thread_nvmpools.tm_buf + ref : (char *)ref);
+    }
+
+    unsigned char fgpt() const { return has_body() ? body()->fgpt : 0; }
+
+    // the same key with its body at p in the NVM pool
+    str_key moved_to(str_key_body *p) const
+    {
+        str_key k;
+        k.raw = (raw & ~(STR_KEY_ADDR | STR_KEY_REF_MASK)) | (uint64_t)((char *)p - the_thread_nvmpools.tm_buf);
+        return k;
+    }
+
+    static uint64_t prefix_of(str_key_body *b)
+    {
+        uint64_t p = (b->len > 0 ? (uint64_t)(unsigned char)b->key[0] << 8 : 0) | (b->len > 1 ? (unsigned char)b->key[1] : 0);
+        return p >> 1;
+    }
+
+    static int compare(str_key a, str_key b)
+    {
+        if (a.raw == b.raw)
+            return 0;
+        if (((a.raw ^ b.raw) >> STR_KEY_PREFIX_SHIFT) || !a.has_body() || !b.has_body())
+            return a.raw < b.raw ? -1 : 1;
+        str_key_body *x = a.body(), *y = b.body();
+        int c = memcmp(x->key, y->key, x->len < y->len ? x->len : y->len);
+        return c ? c : (int)x->len - (int)y->len;
+    }
+
+    bool operator==(const str_key &o) const
+    {
+        if (raw == o.raw)
+            return true;
+        if (((raw ^ o.raw) >> STR_KEY_PREFIX_SHIFT) || !has_body() || !o.has_body())
+            return false;
+        str_key_body *x = body(), *y = o.body();
+        return x->len == y->len && x->fgpt == y->fgpt && memcmp(x->key, y->key, x->len) == 0;
+    }
+    bool operator!=(const str_key &o) const { return !(*this == o); }
+    bool operator<(const str_key &o) const { return compare(*this, o) < 0; }
+    bool operator<=(const str_key &o) const { return compare(*this, o) <= 0; }
+    bool operator>(const str_key &o) const { return compare(*this, o) > 0; }
+    bool operator>=(const str_key &o) const { return compare(*this, o) >= 0; }
+};
+
+static inline uint64_t key_raw(str_key k) { return k.raw; }
+
+template <>
+struct std::hash<str_key>
+{
+    size_t operator()(const str_key &k) const
+    {
+        return k.has_body() ? str_key_hash(k.body()->key, k.body()->len) : k.raw;
+    }
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <vector>
+
+// Out-of-line values (VALUE_HEAP). A value is a blob in the NVM pools, of a size class
+// of whole XPLines so that no two blobs share a line of the media, and the tree holds
+// an 8-byte handle to it: the offset of the blob in the NVM pool, which stays valid
+// wherever the pool is mapped, with its size class in the bits above. Every worker
+// carves blobs out of segments it takes from its own pool, and reuses the blobs of its
+// segments once they are freed, by whichever thread. After a crash the blobs are kept
+// where a recovered handle points, see vheap_mark_used(), and the rest of the segments
+// go back to the pool.
+
+#define VHEAP_LINE 256 // XPLine
+#define VHEAP_MAX_LINES 32
+#define VHEAP_SEGMENT (256 * 1024)
+#define VHEAP_OFFSET_BITS 40 // the handles fit in compact log entries
+#define VHEAP_MAX_WORKERS 100
+
+typedef struct vheap_blob
+{
+    uint32_t len;
+    uint32_t lines;
+    char data[0];
+} vheap_blob;
+
+#define VHEAP_MAX_SIZE (VHEAP_MAX_LINES * VHEAP_LINE - 8) // without the header of the blob
+static_assert(sizeof(vheap_blob) == 8, "");
+
+inline char *vheap_seg_cur[VHEAP_MAX_WORKERS], *vheap_seg_end[VHEAP_MAX_WORKERS];
+inline std::vector<char *> vheap_free_blobs[VHEAP_MAX_WORKERS][VHEAP_MAX_LINES]; // per worker and size class
+
+// the blobs freed by the reclaiming threads, taken over by their worker in vheap_put()
+inline std::vector<char *> vheap_returned[VHEAP_MAX_WORKERS][VHEAP_MAX_LINES];
+inline volatile uint64_t vheap_returned_cnt[VHEAP_MAX_WORKERS][VHEAP_MAX_LINES];
+inline volatile int vheap_returned_lock[VHEAP_MAX_WORKERS];
+
+static inline void vheap_lock(int w)
+{
+    while (__sync_lock_test_and_set(&vheap_returned_lock[w], 1))
+        _mm_pause();
+}
+
+static inline void vheap_unlock(int w)
+{
+    __sync_lock_release(&vheap_returned_lock[w]);
+}
+
+static inline vheap_blob *vheap_blob_of(char *h)
+{
+    return (vheap_blob *)(the_thread_nvmpools.tm_buf + ((uint64_t)h & ((1ULL << VHEAP_OFFSET_BITS) - 1)));
+}
+
+static inline int vheap_lines_of(char *h)
+{
+    return ((uint64_t)h >> VHEAP_OFFSET_BITS) + 1;
+}
+
+// Copy len bytes of data into a new blob and persist it. Return the handle.
+static char *vheap_put(const char *data, int len)
+{
+    assert(len <= VHEAP_MAX_SIZE);
+    int lines = (sizeof(vheap_blob) + len + VHEAP_LINE - 1) / VHEAP_LINE;
+    std::vector<char *> &free_blobs = vheap_free_blobs[worker_id][lines - 1];
+    if (free_blobs.empty() && vheap_returned_cnt[worker_id][lines - 1])
+    {
+        vheap_lock(worker_id);
+        free_blobs.swap(vheap_returned[worker_id][lines - 1]);
+        vheap_returned_cnt[worker_id][lines - 1] = 0;
+        vheap_unlock(worker_id);
+    }
+    char *p;
+    if (!free_blobs.empty())
+    {
+        p = free_blobs.back();
+        free_blobs.pop_back();
+    }
+    else
+    {
+        char *&cur = vheap_seg_cur[worker_id];
+        char *&end = vheap_seg_end[worker_id];
+        if (cur + lines * VHEAP_LINE > end)
+        {
+            // the tail of the segment is left to the smallest class
+            for (; cur + VHEAP_LINE <= end; cur += VHEAP_LINE)
+                vheap_free_blobs[worker_id][0].push_back(cur);
+            cur = (char *)nvmpool_alloc(VHEAP_SEGMENT);
+            end = cur + VHEAP_SEGMENT;
+        }
+        p = cur;
+        cur += lines * VHEAP_LINE;
+    }
+
+    vheap_blob *b = (vheap_blob *)p;
+    b->len = len;
+    b->lines = lines;
+    memcpy(b->data, data, len);
+    clflush(b, sizeof(vheap_blob) + len);
+    return (char *)((uint64_t)(lines - 1) << VHEAP_OFFSET_BITS | (uint64_t)(p - the_thread_nvmpools.tm_buf));
+}
+
+// Copy the value of h into buf, return its length.
+static inline int vheap_read(char *h, char *buf)
+{
+    vheap_blob *b = vheap_blob_of(h);
+    memcpy(buf, b->data, b->len);
+    return b->len;
+}
+
+// an epoch_free_fn, the blob goes back to the worker whose pool it is carved from. Any
+// thread may reclaim it, and the GC threads share a worker id.
+static void vheap_free(void *p)
+{
+    vheap_blob *b = (vheap_blob *)p;
+    int w = the_thread_nvmpools.pool_of(p);
+    vheap_lock(w);
+    vheap_returned[w][b->lines - 1].push_back((char *)p);
+    vheap_returned_cnt[w][b->lines - 1]++;
+    vheap_unlock(w);
+}
+
+// Free the blob of h once no thread in an operation can read it.
+static inline void vheap_retire(char *h)
+{
+    epoch_retire(vheap_blob_of(h), vheap_free);
+}
+
+// Keep the blob of a handle found during crash recovery, in the nodes of node_size
+// bytes it covers. The size comes from the handle, a blob freed before the crash may
+// hold anything.
+static inline void vheap_mark_used(char *h, int node_size)
+{
+    char *p = (char *)vheap_blob_of(h);
+    for (int i = 0; i < vheap_lines_of(h); i++)
+        the_thread_nvmpools.mark_used(p + i * VHEAP_LINE, node_size);
+}
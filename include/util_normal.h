@@ -10,6 +10,7 @@
 #include <vector>
 #include <set>
 #include <queue>
+#include <unordered_map>
 #include <future>
 #include <assert.h>
 #include <random>
@@ -24,7 +25,12 @@
 #include "tools/zipfian_generator.h"
 #include "tools/scrambled_zipfian_generator.h"
 #include "tools/log.h"
+#include "tools/bgthread.h"
+#include "tools/epoch.h"
 #include "tools/nodepref.h"
+#ifdef __cpp_impl_coroutine
+#include "tools/coro.h"
+#endif
 #include <unistd.h>
 #include <sstream>
 
@@ -40,6 +46,15 @@
 // Unified node size,i.e., 256-byte leaf node cotained 14 kvs
 // #define UNIFIED_NODE
 
+// the leaf nodes of CCL-BTree-FF: 256, 512 or 1024 bytes, and the kvs a bnode caches [default 256, 2],
+// fixed for the whole build
+// #define LEAF_NODE_SIZE 512
+// #define BUFFER_SLOTS 2
+
+// the widest vectors of the leaf, bnode and inner page searches of CCL-BTree-FF: 0 SSE,
+// 1 AVX2, 2 AVX-512, as far as the CPU has them [default 2]
+// #define SIMD_PROBE_MAX 0
+
 // overwrite it or just return when find a duplicate key. [defalut open]
 #define INSERT_REPEAT_KEY
 
@@ -59,6 +74,11 @@ inline int parallel_merge_worker_num = 16;
 // open or close the write-conservative logging technique for CCL-BTree
 // #define TREE_NO_SELECLOG
 
+// the number of threads that recycle the bnode buffers of CCL-BTree-FF [default 1]
+#ifndef GC_THREADS
+#define GC_THREADS 1
+#endif
+
 // warm up [default open]
 #define DO_WARMUP
 
@@ -67,23 +87,53 @@ inline int parallel_merge_worker_num = 16;
 
 // #define DO_UPDATE
 
+// update CCL-BTree with upsert_with() and a max merge operator, which keeps the values
+// #define UPDATE_MERGE
+
 // #define DO_SEARCH
 
 // #define DO_SCAN
 
+// scan CCL-BTree with its sorted iterator instead of scan()
+// #define SCAN_ITERATOR
+// with SCAN_ITERATOR, scan CCL-BTree-FF down from the key
+// #define SCAN_REVERSE
+
 // #define DO_DELETE
 
+// insert in batches of INSERT_BATCH keys with insert_batch() of CCL-BTree
+// #define INSERT_BATCH 1024
+
+// search in batches of SEARCH_BATCH keys with multi_get() of CCL-BTree-FF
+// #define SEARCH_BATCH 64
+// with SEARCH_BATCH, search with search_coro() instead, CORO_WIDTH lookups in flight (-std=c++20)
+// #define CORO_WIDTH 8
+
+// warm up CCL-BTree with bulkload() instead of inserts, BULKLOAD_FILL of every leaf node is filled
+// #define DO_BULKLOAD
+#ifndef BULKLOAD_FILL
+#define BULKLOAD_FILL 0.7
+#endif
+
+// CCL-BTree-FF with variable-length string keys, the workload keys become STRING_KEY-byte decimal strings (>= 19)
+// #define STRING_KEY 24
+
+// CCL-BTree-FF with VALUE_HEAP-byte records stored out of line in its NVM value heap
+// #define VALUE_HEAP 1024
+
 /*****************************************************global variable**********************************/
 
 inline __thread int thread_id;
 inline uint64_t num_keys;
 inline uint64_t num_threads;
+inline uint64_t num_log_groups; // the worker threads, the background thread and the other GC threads
 
 inline HistogramSet *hist_set_group[100];
 inline uint64_t elapsed_time_group[100];
 inline uint64_t count_log_group[100];
 inline uint64_t pre_total_log = 0;
 inline uint64_t count_lnode_group[100];
+inline uint64_t lnode_size = 256; // the bytes of a leaf node, set by the tree
 
 inline uint64_t count_error_insert[100];
 inline uint64_t count_error_update[100];
@@ -106,6 +156,8 @@ inline int mmax_length_for_scan = 100 + 64;
 #define NVM_FILE_SIZE 40ULL * 1024ULL * 1024ULL * 1024ULL
 
 #include "tools/mempool.h"
+#include "tools/str_key.h"
+#include "tools/value_heap.h"
 
 static int file_exists(const char *filename)
 {
@@ -114,7 +166,9 @@ static int file_exists(const char *filename)
 }
 
 inline char nvmpool_path[100];
-static void openPmemobjPool()
+// is_recovery: re-open the pool left by a previous run instead of creating a new one.
+// return false if there is no valid pool to recover.
+static bool openPmemobjPool(bool is_recovery = false)
 {
 
 	strcpy(nvmpool_path, NVM_FILE_PATH0);
@@ -123,7 +177,17 @@ static void openPmemobjPool()
 	int sds_write_value = 0;
 	pmemobj_ctl_set(NULL, "sds.at_create", &sds_write_value);
 
+	if (is_recovery)
+	{
+		if (file_exists(nvmpool_path) != 0 || !the_thread_nvmpools.recover(num_threads + 1, nvmpool_path))
+			return false;
+		log_dir_open(true);
+		return true;
+	}
+
 	the_thread_nvmpools.init(num_threads + 1, nvmpool_path, NVM_FILE_SIZE); // the main thread and the background thread(our tree) occupied the last pool.
+	log_dir_open(false);
+	return true;
 }
 
 #define ABORT_INODE 5
@@ -142,16 +206,32 @@ inline free_log_chunks_t global_log_chunks;
 inline vlog_group_t *vlog_groups[100];
 inline log_group_t *log_groups[100];
 inline uint32_t log_file_cnt = 0;
+inline log_dir_t *log_dir;
+inline uint64_t log_commit_window; // in timestamp units, see log_now()
+inline uint64_t log_commit_window_ns;
+inline char *log_file_base[LOG_MAX_FILES];
+inline uint64_t log_ts_base;  // the epoch of the log directory << LOG_TS_CYCLE_BITS
+inline uint64_t log_tsc_open; // the TSC when the log directory was opened
+
+// the timestamp of log entries, log chunk owners and leaf nodes, see LOG_TS_SHIFT
+static inline uint64_t log_now()
+{
+	return log_ts_base + ((_rdtsc() - log_tsc_open) >> LOG_TS_SHIFT);
+}
 
 static void log_init()
 {
 	global_log_chunks.head = (log_chunk_t *)pmem_malloc(sizeof(log_chunk_t *));
 	global_log_chunks.head->next = NULL;
 	pthread_mutex_init(&(global_log_chunks.lock), NULL);
-	for (int i = 0; i <= num_threads; i++)
+	for (int i = 0; i < num_log_groups; i++)
 	{
 		vlog_groups[i] = (vlog_group_t *)malloc(sizeof(vlog_group_t));
 		vlog_groups[i]->alt = 0;
+		vlog_groups[i]->commit_begin = vlog_groups[i]->commit_end = NULL;
+		vlog_groups[i]->commit_begin_ts = 0;
+		vlog_groups[i]->lsn = vlog_groups[i]->durable_lsn = 0;
+		pthread_mutex_init(&(vlog_groups[i]->commit_lock), NULL);
 		log_groups[i] = (log_group_t *)pmem_malloc(sizeof(log_group_t));
 		log_groups[i]->alt = 0;
 		for (int j = 0; j < 2; j++)
@@ -161,6 +241,7 @@ static void log_init()
 		}
 		clflush(log_groups[i], sizeof(log_group_t));
 	}
+	log_set_commit_window(LOG_COMMIT_WINDOW_NS);
 }
 
 static uint64_t total_lnode();
@@ -170,12 +251,119 @@ static int get_log_file_cnt()
 	return log_file_cnt;
 }
 
+/******************************log recycle policy*******************************************/
+// When to recycle the logs. The adaptive policy keeps the log space under a budget:
+// GC starts when the log would grow over the high watermark of the budget before a GC
+// cycle finishes at the current append rate, and goes on until the log is under the
+// low watermark. Over the budget GC always runs, under it only if there is enough
+// garbage to be worth a cycle. Define LOG_RECYCLE_STATIC for the fixed thresholds.
+#ifndef LOG_BUDGET_MB
+#define LOG_BUDGET_MB 0 // 0: LOG_BUDGET_RATIO of the leaf space
+#endif
+#define LOG_BUDGET_RATIO 0.25
+#define LOG_HIGH_WATERMARK 0.8
+#define LOG_LOW_WATERMARK 0.5
+#define LOG_MIN_GARBAGE 0.5
+
+#define LOG_RECYCLE_CHECK_INTERVAL 1024 // the appends of a thread between two checks
+
+typedef struct log_recycle_policy_s log_recycle_policy_t;
+struct log_recycle_policy_s
+{
+	const char *name;
+	bool (*should_recycle)(log_recycle_policy_t *p, uint64_t tot_size, uint64_t garbage_size);
+	void (*recycled)(log_recycle_policy_t *p, uint64_t elapsed_ns); // after a GC cycle
+
+	// the state of the adaptive policy
+	bool active;
+	uint64_t last_ns;
+	uint64_t last_appended;
+	double rate;     // appended bytes per ns
+	uint64_t gc_ns;  // the time of the last GC cycle
+};
+
+static uint64_t log_budget()
+{
+	if (LOG_BUDGET_MB)
+		return LOG_BUDGET_MB * 1024ULL * 1024ULL;
+	return total_lnode() * lnode_size * LOG_BUDGET_RATIO;
+}
+
+static bool static_should_recycle(log_recycle_policy_t *p, uint64_t tot_size, uint64_t garbage_size)
+{
+	return (tot_size > total_lnode() * lnode_size * 0.2) && (garbage_size > tot_size * 0.5);
+}
+
+static bool adaptive_should_recycle(log_recycle_policy_t *p, uint64_t tot_size, uint64_t garbage_size)
+{
+	uint64_t now = NowNanos();
+	uint64_t appended = 0;
+	for (int i = 0; i < num_log_groups; i++)
+		appended += vlog_groups[i]->lsn;
+	appended *= LOG_ENTRY_SIZE;
+
+	if (p->last_ns != 0 && now > p->last_ns)
+	{
+		double rate = (double)(appended - p->last_appended) / (now - p->last_ns);
+		p->rate = (p->rate + rate) / 2;
+	}
+	p->last_ns = now;
+	p->last_appended = appended;
+
+	uint64_t budget = log_budget();
+	if (tot_size >= budget)
+		return true;
+
+	uint64_t projected = tot_size + (uint64_t)(p->rate * p->gc_ns);
+	if (projected >= budget * LOG_HIGH_WATERMARK)
+		p->active = true;
+	else if (tot_size <= budget * LOG_LOW_WATERMARK)
+		p->active = false;
+
+	return p->active && garbage_size >= tot_size * LOG_MIN_GARBAGE;
+}
+
+static void adaptive_recycled(log_recycle_policy_t *p, uint64_t elapsed_ns)
+{
+	p->gc_ns = elapsed_ns;
+}
+
+inline log_recycle_policy_t static_log_recycle = {"static", static_should_recycle, NULL};
+inline log_recycle_policy_t adaptive_log_recycle = {"adaptive", adaptive_should_recycle, adaptive_recycled};
+#ifdef LOG_RECYCLE_STATIC
+inline log_recycle_policy_t *log_recycle_policy = &static_log_recycle;
+#else
+inline log_recycle_policy_t *log_recycle_policy = &adaptive_log_recycle;
+#endif
+inline volatile int log_recycle_checking;
+
+// Called by the writers and the GC timer. Only one caller evaluates the policy at a time.
 static bool if_log_recycle()
 {
+	if (!__sync_bool_compare_and_swap(&log_recycle_checking, 0, 1))
+		return false;
+
 	uint64_t tot_size = get_log_totsize();
-	uint64_t garbage_size = get_flush_totnum() * sizeof(log_entry_t);
+	uint64_t garbage_size = get_flush_totnum() * LOG_ENTRY_SIZE;
+	bool ret = log_recycle_policy->should_recycle(log_recycle_policy, tot_size, garbage_size);
+
+	log_recycle_checking = 0;
+	return ret;
+}
 
-	return (tot_size > total_lnode() * 256 * 0.2) && (garbage_size > tot_size * 0.5);
+static void log_recycled(uint64_t elapsed_ns)
+{
+	if (log_recycle_policy->recycled)
+		log_recycle_policy->recycled(log_recycle_policy, elapsed_ns);
+}
+
+// the longest sleep of the background thread, see bg_wait()
+static uint64_t bg_timeout_ns()
+{
+	uint64_t timeout = BG_GC_INTERVAL_MS * 1000000ULL;
+	if (log_commit_window_ns && (timeout == 0 || log_commit_window_ns < timeout))
+		timeout = log_commit_window_ns;
+	return timeout;
 }
 
 /********************************get pmem space**********************************************/
@@ -262,6 +450,10 @@ static void check_defines()
 	printf("DO_UPDATE\n");
 #endif
 
+#ifdef UPDATE_MERGE
+	printf("UPDATE_MERGE\n");
+#endif
+
 #ifdef DO_SEARCH
 	printf("DO_SEARCH\n");
 #endif
@@ -270,9 +462,73 @@ static void check_defines()
 	printf("DO_SCAN\n");
 #endif
 
+#ifdef SCAN_ITERATOR
+	printf("SCAN_ITERATOR\n");
+#endif
+
+#ifdef SCAN_REVERSE
+	printf("SCAN_REVERSE\n");
+#endif
+
 #ifdef DO_DELETE
 	printf("DO_DELETE\n");
 #endif
+
+#ifdef LOG_COMPACT_ENTRY
+	printf("LOG_COMPACT_ENTRY\n");
+#endif
+
+#ifdef LOG_RECYCLE_STATIC
+	printf("LOG_RECYCLE_STATIC\n");
+#endif
+
+#if LOG_BUDGET_MB
+	printf("LOG_BUDGET_MB = %d\n", LOG_BUDGET_MB);
+#endif
+
+#if GC_THREADS > 1
+	printf("GC_THREADS = %d\n", GC_THREADS);
+#endif
+
+#if INSERT_BATCH
+	printf("INSERT_BATCH = %d\n", INSERT_BATCH);
+#endif
+
+#if SEARCH_BATCH
+	printf("SEARCH_BATCH = %d\n", SEARCH_BATCH);
+#endif
+
+#if CORO_WIDTH
+	printf("CORO_WIDTH = %d\n", CORO_WIDTH);
+#endif
+
+#ifdef LEAF_NODE_SIZE
+	printf("LEAF_NODE_SIZE = %d\n", LEAF_NODE_SIZE);
+#endif
+
+#ifdef BUFFER_SLOTS
+	printf("BUFFER_SLOTS = %d\n", BUFFER_SLOTS);
+#endif
+
+#ifdef SIMD_PROBE_MAX
+	printf("SIMD_PROBE_MAX = %d\n", SIMD_PROBE_MAX);
+#endif
+
+#if STRING_KEY
+	printf("STRING_KEY = %d\n", STRING_KEY);
+#endif
+
+#if VALUE_HEAP
+	printf("VALUE_HEAP = %d\n", VALUE_HEAP);
+#endif
+
+#ifdef DO_BULKLOAD
+	printf("DO_BULKLOAD, BULKLOAD_FILL = %.2f\n", (double)BULKLOAD_FILL);
+#endif
+
+#if LOG_COMMIT_WINDOW_NS
+	printf("LOG_COMMIT_WINDOW_NS = %d\n", LOG_COMMIT_WINDOW_NS);
+#endif
 }
 
 /*****************************************************global variable init**********************************/
@@ -282,6 +538,8 @@ static void init_global_variable()
 
 	worker_id = num_threads; // main thread will share the pmem pool with child thread 0;
 	thread_id = num_threads; // thead id for main thread.
+	num_log_groups = num_threads + GC_THREADS;
+	assert(num_log_groups <= LOG_MAX_GROUPS);
 
 #ifndef FIXED_BACKGROUND
 	parallel_merge_worker_num = num_threads;
@@ -10,6 +10,7 @@
 #include <vector>
 #include <set>
 #include <queue>
+#include <unordered_map>
 #include <future>
 #include <assert.h>
 #include <random>
@@ -25,8 +26,13 @@
 #include "tools/utils.h"
 #include "tools/zipfian_generator.h"
 #include "tools/scrambled_zipfian_generator.h"
+#include "tools/bgthread.h"
+#include "tools/epoch.h"
 
 #include "tools/nodepref.h"
+#ifdef __cpp_impl_coroutine
+#include "tools/coro.h"
+#endif
 #include <unistd.h>
 #include <sstream>
 
@@ -79,6 +85,12 @@ inline int parallel_merge_worker_num = 16;
 
 // #define DO_DELETE
 
+// warm up CCL-BTree with bulkload() instead of inserts, BULKLOAD_FILL of every leaf node is filled
+// #define DO_BULKLOAD
+#ifndef BULKLOAD_FILL
+#define BULKLOAD_FILL 0.7
+#endif
+
 /*****************************************************global variable**********************************/
 
 inline __thread int thread_id;
@@ -90,6 +102,7 @@ inline uint64_t elapsed_time_group[100];
 inline uint64_t count_log_group[100];
 inline uint64_t pre_total_log = 0;
 inline uint64_t count_lnode_group[100];
+inline uint64_t lnode_size = 256; // the bytes of a leaf node, set by the tree
 
 inline uint64_t count_error_insert[100];
 inline uint64_t count_error_update[100];
@@ -251,6 +264,9 @@ static void openPmemobjPool()
 // extend to numa
 #include "tools/log_numa.h"
 
+// the NUMA logs are not recovered, their timestamps only order the entries of a run
+static inline uint64_t log_now() { return _rdtsc(); }
+
 inline nvmLogPool per_numa_log_pool[NUM_NUMA_NODE];
 
 #define the_logpool (per_numa_log_pool[thread_id / NUM_CORE_PER_NUMA].thread_log_pool[thread_id % NUM_CORE_PER_NUMA])
@@ -299,7 +315,19 @@ static bool if_log_recycle()
 	uint64_t tot_size = get_log_totsize();
 	uint64_t garbage_size = get_flush_totnum() * sizeof(log_entry_t);
 
-	return (tot_size > total_lnode() * 256 * 0.2) && (garbage_size > tot_size * 0.5);
+	return (tot_size > total_lnode() * lnode_size * 0.2) && (garbage_size > tot_size * 0.5);
+}
+
+#define LOG_RECYCLE_CHECK_INTERVAL 10000 // the appends of a thread between two checks
+
+static void log_recycled(uint64_t elapsed_ns)
+{
+}
+
+// the longest sleep of the background thread, see bg_wait()
+static uint64_t bg_timeout_ns()
+{
+	return BG_GC_INTERVAL_MS * 1000000ULL;
 }
 
 /********************************get pmem space**********************************************/
@@ -10,6 +10,7 @@ CPPPATH="include/tools/mempool.c include/tools/log.cpp"
 
 threads=(47)
 scansize=(100)
+runs=1
 
 if [ $# -ne 1 ]
 then
@@ -37,10 +38,74 @@ then
         defines=$defines" -DTREE_NO_SEARCHCACHE" 
         fi
        
+        if [ $para = "recovery" ]; then
+        # the first run exits after inserting, the second run recovers the tree
+        runs=2
+        defines=$defines" -DDO_RECOVERY -DDO_SEARCH"
+        fi
+
+        if [ $para = "groupcommit" ]; then
+        defines=$defines" -DLOG_COMMIT_WINDOW_NS=10000"
+        fi
+
+        if [ $para = "compactlog" ]; then
+        defines=$defines" -DLOG_COMPACT_ENTRY"
+        fi
+
+        if [ $para = "batch" ]; then
+        defines=$defines" -DINSERT_BATCH=1024"
+        fi
+
+        if [ $para = "multiget" ]; then
+        defines=$defines" -DSEARCH_BATCH=64"
+        fi
+
+        if [ $para = "coro" ]; then
+        defines=$defines" -DSEARCH_BATCH=64 -DCORO_WIDTH=8 -std=c++20"
+        fi
+
+        if [ $para = "merge" ]; then
+        defines=$defines" -DUPDATE_MERGE"
+        fi
+
+        if [ $para = "leaf512" ]; then
+        defines=$defines" -DLEAF_NODE_SIZE=512"
+        fi
+
+        if [ $para = "leaf1024" ]; then
+        defines=$defines" -DLEAF_NODE_SIZE=1024"
+        fi
+
+        if [ $para = "sse" ]; then
+        defines=$defines" -DSIMD_PROBE_MAX=0"
+        fi
+
+        if [ $para = "strkey" ]; then
+        defines=$defines" -DSTRING_KEY=24"
+        fi
+
+        if [ $para = "valueheap" ]; then
+        defines=$defines" -DVALUE_HEAP=1024"
+        fi
+
+        if [ $para = "bulkload" ]; then
+        defines=$defines" -DDO_BULKLOAD"
+        fi
+
         if [ $para = "scan" ]; then
         scansize=(20 50 100 200 400)
         defines=$defines" -DDO_SCAN" 
         fi
+
+        if [ $para = "scaniter" ]; then
+        scansize=(20 50 100 200 400)
+        defines=$defines" -DDO_SCAN -DSCAN_ITERATOR"
+        fi
+
+        if [ $para = "scanrev" ]; then
+        scansize=(20 50 100 200 400)
+        defines=$defines" -DDO_SCAN -DSCAN_ITERATOR -DSCAN_REVERSE"
+        fi
     done
 else
     # threads=(1)
@@ -61,8 +126,11 @@ for num_threads in ${threads[@]}
 do
 for ssize in ${scansize[@]}
 do
+for ((run = 0; run < runs; run++))
+do
 numactl --membind=1 --cpunodebind=1 ./mybin/m_normal_test_cclbtree_lb $num_keys $num_threads $ssize
 wait
+done
 rm -rf /mnt/pmem/cclbtree/leafdata
 wait
 done
@@ -77,8 +145,11 @@ for num_threads in ${threads[@]}
 do
 for ssize in ${scansize[@]}
 do
+for ((run = 0; run < runs; run++))
+do
 numactl --membind=1 --cpunodebind=1 ./mybin/m_normal_test_cclbtree_ff $num_keys $num_threads $ssize
 wait
+done
 rm -rf /mnt/pmem/cclbtree/leafdata
 wait
 done
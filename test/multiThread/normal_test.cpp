@@ -37,10 +37,18 @@ int main(int argc, char **argv)
     key_type_sob *keys = (key_type_sob *)malloc(num_keys * sizeof(key_type_sob));
     assert(keys);
     std::random_device rd;
+#ifdef DO_RECOVERY
+    std::mt19937_64 eng(num_keys); // the run that recovers the tree needs the same keys
+#else
     std::mt19937_64 eng(rd());
+#endif
 
     // std::uniform_int_distribution<key_type_sob> uniform_dist(1, num_keys);
+#if defined(LOG_COMPACT_ENTRY) && (defined(CCLBTREE_LB) || defined(CCLBTREE_FF))
+    std::uniform_int_distribution<key_type_sob> uniform_dist(1, LOG_COMPACT_MAX_KEY); // compact log entries hold 48-bit keys
+#else
     std::uniform_int_distribution<key_type_sob> uniform_dist;
+#endif
 #ifndef ZIPFIAN
     for (uint64_t i = 0; i < num_keys;)
     {
@@ -71,9 +79,23 @@ int main(int argc, char **argv)
 
     /************************************ global variable*************************************/
 
-    openPmemobjPool();
+    bool is_recovery = false;
+#if defined(DO_RECOVERY) && (defined(CCLBTREE_LB) || defined(CCLBTREE_FF))
+    // recover the tree left by the previous run if there is one.
+    is_recovery = openPmemobjPool(true);
+    if (is_recovery)
+    {
+        time_start = NowNanos();
+        tree_recover();
+        printf("%d threads recovery time cost is %llu ns.\n", num_threads, ElapsedNanos(time_start));
+    }
+#endif
 
-    tree_init();
+    if (!is_recovery)
+    {
+        openPmemobjPool();
+        tree_init();
+    }
 
     printf("after tree_init() : dram space (RSS) = %fMB\n", (getRSS() - ini_dram_space) / 1024.0 / 1024);
 
@@ -83,97 +105,133 @@ int main(int argc, char **argv)
 
     //***************************warm up**********************//
 #ifdef DO_WARMUP
-    time_start = NowNanos();
-    for (uint64_t tid = 0; tid < num_threads; tid++)
+    if (!is_recovery)
     {
+#if defined(DO_BULKLOAD) && (defined(CCLBTREE_LB) || defined(CCLBTREE_FF))
+        // the bulk loader takes sorted, distinct keys
+        std::vector<key_type_sob> sorted_keys(keys, keys + num_keys / 2);
+        std::sort(sorted_keys.begin(), sorted_keys.end());
+        sorted_keys.erase(std::unique(sorted_keys.begin(), sorted_keys.end()), sorted_keys.end());
+
+        time_start = NowNanos();
+        tree_bulkload(sorted_keys.data(), sorted_keys.size());
+        printf("%d threads bulk load time cost is %llu ns.\n", num_threads, ElapsedNanos(time_start));
+#else
+        time_start = NowNanos();
+        for (uint64_t tid = 0; tid < num_threads; tid++)
+        {
 
-        uint64_t from = data_per_thread * tid;
-        uint64_t to = (tid == num_threads - 1) ? num_keys / 2 : from + data_per_thread;
-        auto f = async(
-            launch::async,
-            [&](uint64_t from, uint64_t to, uint64_t tid)
-            {
+            uint64_t from = data_per_thread * tid;
+            uint64_t to = (tid == num_threads - 1) ? num_keys / 2 : from + data_per_thread;
+            auto f = async(
+                launch::async,
+                [&](uint64_t from, uint64_t to, uint64_t tid)
+                {
 #ifdef PIN_CPU
-                pin_cpu_core(tid);
+                    pin_cpu_core(tid);
 #endif
 
-                worker_id = tid;
-                thread_id = tid;
+                    worker_id = tid;
+                    thread_id = tid;
 
-                for (uint64_t i = from; i < to; ++i)
-                {
-                    tree_insert(keys[i]);
-                }
-            },
-            from, to, tid);
-        futures.push_back(move(f));
-    }
-    for (auto &&f : futures)
-        if (f.valid())
-        {
-            f.get();
+                    for (uint64_t i = from; i < to; ++i)
+                    {
+                        tree_insert(keys[i]);
+                    }
+                },
+                from, to, tid);
+            futures.push_back(move(f));
         }
-    printf("%d threads warm up time cost is %llu ns. error_count = %lld\n", num_threads, ElapsedNanos(time_start), total_error_insert());
-    // CCL-BTree needs a long time to warm up because of the pre-touching of NVM log files.
+        for (auto &&f : futures)
+            if (f.valid())
+            {
+                f.get();
+            }
+        printf("%d threads warm up time cost is %llu ns. error_count = %lld\n", num_threads, ElapsedNanos(time_start), total_error_insert());
+#endif
+        // CCL-BTree needs a long time to warm up because of the pre-touching of NVM log files.
 
 #ifdef DPTREE
-    printf("wait for background..\n");
-    while (bt->is_merging())
-        ;
+        printf("wait for background..\n");
+        while (bt->is_merging())
+            ;
 #endif
 
-    printf("dram space after warmup: %fMB\n", getRSS() / 1024.0 / 1024);
+        printf("dram space after warmup: %fMB\n", getRSS() / 1024.0 / 1024);
+    }
 #endif // DO_WARMUP
 
     //***************************insert op*******************************//
 #ifdef DO_INSERT
 
 #ifndef MIXED_WORKLOAD
-    clear_cache();
-    futures.clear();
+    if (!is_recovery)
+    {
+        clear_cache();
+        futures.clear();
 
-    time_start = NowNanos();
+        time_start = NowNanos();
 
-    for (uint64_t tid = 0; tid < num_threads; tid++)
-    {
-        uint64_t from = data_per_thread * tid + num_keys / 2;
-        uint64_t to = (tid == num_threads - 1) ? num_keys : from + data_per_thread;
+        for (uint64_t tid = 0; tid < num_threads; tid++)
+        {
+            uint64_t from = data_per_thread * tid + num_keys / 2;
+            uint64_t to = (tid == num_threads - 1) ? num_keys : from + data_per_thread;
 
-        auto f = async(
-            launch::async,
-            [&](uint64_t from, uint64_t to, uint64_t tid)
-            {
+            auto f = async(
+                launch::async,
+                [&](uint64_t from, uint64_t to, uint64_t tid)
+                {
 #ifdef PIN_CPU
-                pin_cpu_core(tid);
+                    pin_cpu_core(tid);
 #endif
 
-                worker_id = tid;
-                thread_id = tid;
+                    worker_id = tid;
+                    thread_id = tid;
 
-                for (uint64_t i = from; i < to; ++i)
-                {
-                    tree_insert(keys[i]);
-                }
-            },
-            from, to, tid);
-        futures.push_back(move(f));
-    }
+#if INSERT_BATCH && (defined(CCLBTREE_LB) || defined(CCLBTREE_FF))
+                    for (uint64_t i = from; i < to; i += INSERT_BATCH)
+                    {
+                        tree_insert_batch(&keys[i], std::min((uint64_t)INSERT_BATCH, to - i));
+                    }
+#else
+                    for (uint64_t i = from; i < to; ++i)
+                    {
+                        tree_insert(keys[i]);
+                    }
+#endif
+                },
+                from, to, tid);
+            futures.push_back(move(f));
+        }
 
-    for (auto &&f : futures)
-        if (f.valid())
-            f.get();
-    printf("%d threads insert time cost is %llu ns. error_count = %lld\n", num_threads, ElapsedNanos(time_start), total_error_insert());
+        for (auto &&f : futures)
+            if (f.valid())
+                f.get();
+        printf("%d threads insert time cost is %llu ns. error_count = %lld\n", num_threads, ElapsedNanos(time_start), total_error_insert());
 
 #ifdef DPTREE
-    printf("wait for background..\n");
-    while (bt->is_merging())
-        ;
+        printf("wait for background..\n");
+        while (bt->is_merging())
+            ;
 #endif
 
-    printf("dram space after insert: %fMB\n", getRSS() / 1024.0 / 1024);
-
+        printf("dram space after insert: %fMB\n", getRSS() / 1024.0 / 1024);
+    }
 #endif // DO_INSERT
 
+#ifdef DO_RECOVERY
+    if (!is_recovery)
+    {
+        // exit without tearing down the tree, as a crash does. The next run recovers it.
+#ifndef NUMA_TEST
+        log_commit_all();
+#endif
+        printf("exit without cleanup, run again to recover the tree.\n");
+        fflush(stdout);
+        _exit(0);
+    }
+#endif
+
     //***************************update op*******************************//
 #ifdef DO_UPDATE
 
@@ -247,10 +305,17 @@ int main(int argc, char **argv)
                 pin_cpu_core(tid);
 #endif
                 thread_id = tid;
+#if SEARCH_BATCH && defined(CCLBTREE_FF)
+                for (uint64_t i = from; i < to; i += SEARCH_BATCH)
+                {
+                    tree_multi_get(&keys[i], std::min((uint64_t)SEARCH_BATCH, to - i));
+                }
+#else
                 for (uint64_t i = from; i < to; ++i)
                 {
                     tree_search(keys[i]);
                 }
+#endif
             },
             from, to, tid);
         futures.push_back(move(f));
@@ -378,6 +443,14 @@ int main(int argc, char **argv)
     printf("log_totsize = %fMB\n", get_log_totsize() / 1024.0 / 1024);
 #endif
 
+#ifdef CCLBTREE_FF
+    tree->print_gc_stats();
+#endif
+
+#if defined(CCLBTREE_LB) && defined(OPEN_RTM)
+    print_rtm_stats();
+#endif
+
 #ifdef PACTREE
     tree_get_memory_footprint();
 #endif
@@ -385,6 +458,7 @@ int main(int argc, char **argv)
     // background threads
 #if defined(CCLBTREE_LB) || defined(CCLBTREE_FF)
     signal_run_bgthread = false;
+    bg_wake();
     bg_thread.get();
 #endif
 
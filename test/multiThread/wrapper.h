@@ -5,6 +5,10 @@
 
 #define CHECK_RESULT
 
+#if (defined(STRING_KEY) || defined(VALUE_HEAP)) && !defined(CCLBTREE_FF)
+#error "STRING_KEY and VALUE_HEAP are only supported by CCL-BTree-FF"
+#endif
+
 #if defined(FASTFAIR)
 #include "btree.h"
 
@@ -248,6 +252,12 @@ inline void tree_init()
     bt = new tree();
 };
 
+inline void tree_recover()
+{
+    printf("recover multi-threads cclbtree_lb!\n");
+    bt = new tree(true);
+};
+
 inline void tree_insert(key_type_sob key)
 {
 #if defined(INSERT_REPEAT_KEY)
@@ -269,9 +279,30 @@ inline void tree_search(key_type_sob key)
 #endif
 };
 
+inline void tree_insert_batch(key_type_sob *keys, int n)
+{
+    bt->insert_batch(keys, keys, n);
+};
+
+inline void tree_bulkload(key_type_sob *keys, uint64_t n)
+{
+    bt->bulkload(keys, keys, n, BULKLOAD_FILL);
+};
+
+#ifdef UPDATE_MERGE
+static value_type_sob merge_max(value_type_sob old, value_type_sob operand)
+{
+    return std::max(old, operand);
+}
+#endif
+
 inline void tree_update(key_type_sob key)
 {
+#ifdef UPDATE_MERGE
+    bt->upsert_with(key, merge_max, key);
+#else
     bt->insert_lnode(key, key, true);
+#endif
 };
 inline void tree_delete(key_type_sob key)
 {
@@ -280,9 +311,17 @@ inline void tree_delete(key_type_sob key)
 
 inline void tree_scan(key_type_sob min_key, uint64_t length, std::vector<value_type_sob> &buf)
 {
+#ifdef SCAN_ITERATOR
+    // the kvs come in key order, no sort
+    tree_iterator it(bt);
+    for (it.seek(min_key); it.valid() && buf.size() < length; it.next())
+        buf.push_back((value_type_sob)it.value());
+    int res = buf.size();
+#else
     int res = bt->scan(min_key, length, buf);
 
     std::sort(buf.begin(), buf.end());
+#endif
 
     if (unlikely(res == 0))
     {
@@ -355,11 +394,57 @@ inline void tree_scan(key_type_sob min_key, uint64_t length, std::vector<value_t
 #include "cclbtree_ff.h"
 
 btree *tree;
+
+#ifdef STRING_KEY
+#if STRING_KEY < 19 || STRING_KEY > STR_KEY_MAX_LEN
+#error "STRING_KEY must hold the 19 digits of a key"
+#endif
+#define STR_PROBE_SIZE (sizeof(str_key_body) + STRING_KEY)
+
+// key as its 19 decimal digits, padded with zeros after them to STRING_KEY bytes, in buf.
+// The strings sort like the keys, and their first bytes vary with the leading digits
+// of the keys instead of being the padding.
+static entry_key_t str_key_of(key_type_sob key, char *buf)
+{
+    char s[STRING_KEY + 1];
+    snprintf(s, sizeof(s), "%019lu", (uint64_t)key);
+    memset(s + 19, '0', STRING_KEY - 19);
+    return str_key((str_key_body *)buf, s, STRING_KEY);
+}
+
+inline thread_local char str_probe[STR_PROBE_SIZE];
+#define KEY(k) str_key_of(k, str_probe)
+#else
+#define KEY(k) (k)
+#endif
+
+#ifdef VALUE_HEAP
+#if VALUE_HEAP < 8 || VALUE_HEAP > VHEAP_MAX_SIZE
+#error "VALUE_HEAP must hold a key and fit in the largest size class"
+#endif
+#if defined(INSERT_BATCH) || defined(SEARCH_BATCH) || defined(DO_BULKLOAD) || defined(UPDATE_MERGE)
+#error "the batched operations and UPDATE_MERGE write the values as they are"
+#endif
+// a record of VALUE_HEAP bytes that starts with its key
+inline thread_local char record[VALUE_HEAP];
+
+static void put_record(key_type_sob key)
+{
+    memcpy(record, &key, sizeof(key));
+    tree->put_value(KEY(key), record, VALUE_HEAP);
+}
+#endif
 inline void tree_init()
 {
     printf("init for multi-threads cclbtree_ff!\n");
     tree = new btree();
 };
+
+inline void tree_recover()
+{
+    printf("recover multi-threads cclbtree_ff!\n");
+    tree = new btree(true);
+};
 inline void tree_end()
 {
     delete tree;
@@ -367,39 +452,137 @@ inline void tree_end()
 
 inline void tree_search(key_type_sob key)
 {
-    char *res = tree->search(key);
+#ifdef VALUE_HEAP
+    int len = tree->get_value(KEY(key), record);
+#ifdef CHECK_RESULT
+    if (unlikely(len != VALUE_HEAP || *(key_type_sob *)record != key))
+    {
+        count_error_search[thread_id]++;
+    }
+#endif
+#else
+    char *res = tree->search(KEY(key));
 #ifdef CHECK_RESULT
     if (unlikely(res != (char *)key))
     {
         count_error_search[thread_id]++;
     }
 #endif
+#endif
 };
 
 inline void tree_insert(key_type_sob key)
 {
-#if defined(INSERT_REPEAT_KEY)
-    tree->insert(key, (char *)key, true);
+#ifdef VALUE_HEAP
+    put_record(key);
+#elif defined(INSERT_REPEAT_KEY)
+    tree->insert(KEY(key), (char *)key, true);
+#else
+    tree->insert(KEY(key), (char *)key, false);
+#endif
+};
+
+inline void tree_insert_batch(key_type_sob *keys, int n)
+{
+#ifdef STRING_KEY
+    std::vector<char> probes(n * STR_PROBE_SIZE);
+    std::vector<entry_key_t> skeys(n);
+    for (int i = 0; i < n; i++)
+        skeys[i] = str_key_of(keys[i], &probes[i * STR_PROBE_SIZE]);
+    tree->insert_batch(skeys.data(), (char **)keys, n);
+#else
+    tree->insert_batch(keys, (char **)keys, n);
+#endif
+};
+
+#if SEARCH_BATCH
+inline void tree_multi_get(key_type_sob *keys, int n)
+{
+    char *res[SEARCH_BATCH];
+    bool found[SEARCH_BATCH];
+#ifdef STRING_KEY
+    static thread_local char probes[SEARCH_BATCH][STR_PROBE_SIZE];
+    entry_key_t skeys[SEARCH_BATCH];
+    for (int i = 0; i < n; i++)
+        skeys[i] = str_key_of(keys[i], probes[i]);
+#else
+    entry_key_t *skeys = keys;
+#endif
+#if CORO_WIDTH
+    coro_scheduler sched(CORO_WIDTH);
+    for (int i = 0; i < n; i++)
+        sched.spawn(tree->search_coro(skeys[i], &res[i], &found[i]));
+    sched.run();
+#else
+    tree->multi_get(skeys, n, res, found);
+#endif
+#ifdef CHECK_RESULT
+    for (int i = 0; i < n; i++)
+        if (unlikely(!found[i] || res[i] != (char *)keys[i]))
+        {
+            count_error_search[thread_id]++;
+        }
+#endif
+};
+#endif
+
+inline void tree_bulkload(key_type_sob *keys, uint64_t n)
+{
+#ifdef STRING_KEY
+    std::vector<char> probes(n * STR_PROBE_SIZE);
+    std::vector<entry_key_t> skeys(n);
+    for (uint64_t i = 0; i < n; i++)
+        skeys[i] = str_key_of(keys[i], &probes[i * STR_PROBE_SIZE]);
+    tree->bulkload(skeys.data(), (char **)keys, n, BULKLOAD_FILL);
 #else
-    tree->insert(key, (char *)key, false);
+    tree->bulkload(keys, (char **)keys, n, BULKLOAD_FILL);
 #endif
 };
 
+#ifdef UPDATE_MERGE
+static char *merge_max(char *old, char *operand)
+{
+    return (old == TOMBSTONE) ? operand : std::max(old, operand);
+}
+#endif
+
 inline void tree_update(key_type_sob key)
 {
-    tree->insert(key, (char *)key, true);
+#ifdef VALUE_HEAP
+    put_record(key);
+#elif defined(UPDATE_MERGE)
+    tree->upsert_with(KEY(key), merge_max, (char *)key);
+#else
+    tree->insert(KEY(key), (char *)key, true);
+#endif
 };
 
 inline void tree_delete(key_type_sob key)
 {
-    tree->insert(key, (char *)0, true);
+#ifdef VALUE_HEAP
+    tree->erase_value(KEY(key));
+#else
+    tree->insert(KEY(key), TOMBSTONE, true);
+#endif
 };
 
 inline void tree_scan(key_type_sob min_key, uint64_t length, std::vector<value_type_sob> &buf)
 {
-    int res = tree->btree_search_range(min_key, length, buf);
+#ifdef SCAN_ITERATOR
+    // the kvs come in key order, no sort
+    btree_iterator it(tree);
+#ifdef SCAN_REVERSE
+    for (it.seek_for_prev(min_key); it.valid() && buf.size() < length; it.prev())
+#else
+    for (it.seek(KEY(min_key)); it.valid() && buf.size() < length; it.next())
+#endif
+        buf.push_back((value_type_sob)it.value());
+    int res = buf.size();
+#else
+    int res = tree->btree_search_range(KEY(min_key), length, buf);
 
     std::sort(buf.begin(), buf.end());
+#endif
 
 #ifdef CHECK_RESULT
     if (unlikely(res == 0))